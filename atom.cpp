@@ -21,91 +21,324 @@
 
 #include "AP_AtomDefinitions.h"
 #include "atom.h"
+#include "byteorder.h"
 
-#include <map>
 #include <iostream>
+#include <algorithm>
+#include <new>          //for: placement new
 
 #include <cstring>      //for: memcpy()
 #include <cassert>
 
+extern "C" {
+#include <pthread.h>
+#include <stdlib.h>     //for: posix_memalign()
+}
+
 using namespace std;
 
 
 namespace {
-    // Read an unaligned, big-endian value.
-    // A compiler will optimize this (at -O2) to a single instruction if possible.
-    template<class T> 
-    static inline T readBE(const uint8_t *p, size_t i = 0) {
-        return (i >= sizeof(T)) ? T(0) :
-                (T(*p) << ((sizeof(T) - 1 - i) * 8)) | readBE<T>(p + 1, i + 1);
-    };
+    // Atom definitions map.
+    static inline uint32_t id2Key(const char *id) {
+        const unsigned char *uid = reinterpret_cast<const unsigned char*>(id);
+        return ((uint32_t(uid[0]) << 24) | (uint32_t(uid[1]) << 16) | (uint32_t(uid[2]) << 8) | uid[3]);
+    }
 
-    template<class T>
-    static inline void readBE(T &result, const uint8_t *p) { result = readBE<T>(p); };
+    // Known atoms by FourCC: an open addressing hash table, filled once.
+    class DefinitionTable {
+    public:
+        DefinitionTable() {
+            memset(keys, 0, sizeof(keys));
+            memset(defs, 0, sizeof(defs));
+            for(unsigned int i = 1; i < sizeof(KnownAtoms)/sizeof(KnownAtoms[0]); ++i) {
+                //for each atom name include the last of multiple definitions
+                uint32_t key = id2Key(KnownAtoms[i].known_atom_name);
+                unsigned int slot = hash(key);
+                while(defs[slot] && keys[slot] != key)
+                    slot = (slot + 1) & (Slots - 1);
+                keys[slot] = key;
+                defs[slot] = &KnownAtoms[i];
+            }
+        }
 
-    // Write an unaligned, big-endian value.
-    template<class T>
-    static inline void writeBE(uint8_t *p, T value, size_t i = 0) {
-        (i >= sizeof(T)) ? void(0) :
-            (*p = ((value >> ((sizeof(T) - 1 - i) * 8)) & 0xFF) , writeBE(p + 1, value, i + 1));
+        const AtomDefinition *find(uint32_t key) const {
+            for(unsigned int slot = hash(key); defs[slot]; slot = (slot + 1) & (Slots - 1)) {
+                if(keys[slot] == key)
+                    return defs[slot];
+            }
+            return NULL;
+        }
+
+    private:
+        //1024 slots for the 168 names in KnownAtoms: less than a sixth full, so probe
+        // sequences stay short (keep it under half full when adding atoms)
+        static const unsigned int SlotBits = 10;
+        static const unsigned int Slots    = 1u << SlotBits;
+
+        uint32_t              keys[Slots];
+        const AtomDefinition *defs[Slots];
+
+        static unsigned int hash(uint32_t key) { return (key * 2654435761u) >> (32 - SlotBits); }
     };
 
-    // Read an unaligned value in native-endian format.
-    // Encode the unaligned access intention by using memcpy() with its
-    //  destination and source pointing to types with the wanted alignment.
-    // Some compilers use the alignments of these types for further optimizations.
-    // A compiler can optimize this memcpy() into a single instruction.
-    template<class T>
-    static inline T readNE(const uint8_t *p) {
-        T value;
-        memcpy(&value, p, sizeof(value));
-        return value;
+    size_t countAtoms(const Atom *atom) {
+        size_t count = 1;
+        for(size_t i = 0; i < atom->childCount(); i++)
+            count += countAtoms(atom->child(i));
+        return count;
     }
 
-    template<class T>
-    static inline void readNE(T &result, const uint8_t *p) {
-        memcpy(&result, p, sizeof(result));
+    //atoms Atom::parseChildren() makes of data[0, size), descendants included;
+    // one more for an atom it fails on
+    size_t countParsed(const unsigned char *data, int64_t size) {
+        size_t  count = 0;
+        int64_t pos   = 0;
+        while(pos < size) {
+            const unsigned char *p = data + pos;
+            int64_t left = size - pos;
+            if(left < 8)
+                return count + 1;
+            uint64_t length = readBE<uint32_t>(p);
+            int64_t  header = 8;
+            if(length == 1) {
+                if(left < 16)
+                    return count + 1;
+                length = readBE<uint64_t>(p + 8) - 8;
+                header = 16;
+            } else if(length == 0) {
+                length = left;
+            }
+            if(length < 8 || length - 8 > uint64_t(left - header))
+                return count + 1;
+            count++;
+            char name[5];
+            memcpy(name, p + 4, 4);
+            name[4] = '\0';
+            if(Atom::isParent(name) && name != string("udta"))
+                count += countParsed(p + header, length - 8);
+            pos += header + length - 8;
+        }
+        return count;
     }
 
+    //copies [begin, end) of a source to an output: a reader thread fills a few large
+    // buffers while the caller writes out the ones already filled. A mapped source is
+    // copied out of the mapping, so its page faults (the disk reads) are the reader's
+    class CopyPipeline {
+    public:
+        static const int    Buffers    = 3;
+        static const size_t BufferSize = 4 << 20;
+        static const size_t Alignment  = 4096;  //buffers can be handed to direct I/O
+
+        CopyPipeline(File &source, int64_t begin, int64_t end);
+        ~CopyPipeline();
+
+        //false if the buffers or the reader thread could not be had (nothing was written)
+        bool run(File &output);
+
+    private:
+        File          &source;
+        int64_t        begin;
+        int64_t        end;
+        unsigned char *buffers[Buffers];
+        int            filled;      //buffers read and not written yet
+        bool           failed;      //reading failed
+        bool           stopped;     //writing failed: the reader must quit
+        pthread_mutex_t mutex;
+        pthread_cond_t  changed;
+
+        static void *readLoop(void *pipeline);
+        void read();
+
+        CopyPipeline(const CopyPipeline&);
+        CopyPipeline& operator=(const CopyPipeline&);
+    };
 
-    // Atom definitions map.
-    static inline uint32_t id2Key(const char *id) {
-        const unsigned char *uid = reinterpret_cast<const unsigned char*>(id);
-        return ((uint32_t(uid[0]) << 24) | (uint32_t(uid[1]) << 16) | (uint32_t(uid[2]) << 8) | uid[3]);
+    CopyPipeline::CopyPipeline(File &s, int64_t b, int64_t e)
+        : source(s), begin(b), end(e), filled(0), failed(false), stopped(false) {
+        for(int i = 0; i < Buffers; i++) {
+            void *p = NULL;
+            buffers[i] = (posix_memalign(&p, Alignment, BufferSize) == 0) ? static_cast<unsigned char *>(p) : NULL;
+        }
+        pthread_mutex_init(&mutex, NULL);
+        pthread_cond_init(&changed, NULL);
     }
 
-    AtomDefinition definition(const char *id) {
-        static const AtomDefinition def_unknown = KnownAtoms[0];
-        static map<uint32_t, AtomDefinition> def;
-        if(def.empty()) {
-            for(unsigned int i = 1; i < sizeof(KnownAtoms)/sizeof(KnownAtoms[0]); ++i) {
-#if 1
-                //for each atom name include the last of multiple definitions
-                def[id2Key(KnownAtoms[i].known_atom_name)] = KnownAtoms[i];
-#else
-                //for each atom name include only the first of multiple definitions
-                def.insert(make_pair(id2Key(KnownAtoms[i].known_atom_name), KnownAtoms[i]));
-#endif
+    CopyPipeline::~CopyPipeline() {
+        pthread_cond_destroy(&changed);
+        pthread_mutex_destroy(&mutex);
+        for(int i = 0; i < Buffers; i++)
+            free(buffers[i]);
+    }
+
+    void *CopyPipeline::readLoop(void *pipeline) {
+        static_cast<CopyPipeline *>(pipeline)->read();
+        return NULL;
+    }
+
+    void CopyPipeline::read() {
+        const unsigned char *mapped = (source.isMapped() && end <= int64_t(source.mappedSize())) ? source.mapped() : NULL;
+        if(!mapped)
+            source.seek(begin);
+        int next = 0;
+        for(int64_t offset = begin; offset < end; offset += BufferSize) {
+            pthread_mutex_lock(&mutex);
+            while(filled == Buffers && !stopped)
+                pthread_cond_wait(&changed, &mutex);
+            bool quit = stopped;
+            pthread_mutex_unlock(&mutex);
+            if(quit)
+                return;
+
+            //fill outside of the lock: the writer only uses filled buffers
+            size_t size = size_t(min(int64_t(BufferSize), end - offset));
+            bool ok = true;
+            if(mapped) {
+                memcpy(buffers[next], mapped + offset, size);
+            } else {
+                try {
+                    source.readChar(reinterpret_cast<char *>(buffers[next]), size);
+                } catch(string) {
+                    ok = false;
+                }
             }
+
+            pthread_mutex_lock(&mutex);
+            if(ok)
+                filled++;
+            else
+                failed = true;
+            pthread_cond_signal(&changed);
+            pthread_mutex_unlock(&mutex);
+            if(!ok)
+                return;
+            next = (next + 1) % Buffers;
+        }
+    }
+
+    bool CopyPipeline::run(File &output) {
+        for(int i = 0; i < Buffers; i++)
+            if(!buffers[i])
+                return false;
+
+        pthread_t reader;
+        if(pthread_create(&reader, NULL, readLoop, this) != 0)
+            return false;
+
+        bool write_failed = false;
+        int  next = 0;
+        for(int64_t offset = begin; offset < end && !write_failed; offset += BufferSize) {
+            pthread_mutex_lock(&mutex);
+            while(filled == 0 && !failed)
+                pthread_cond_wait(&changed, &mutex);
+            bool read_failed = (filled == 0);
+            pthread_mutex_unlock(&mutex);
+            if(read_failed)
+                break;
+
+            size_t size = size_t(min(int64_t(BufferSize), end - offset));
+            write_failed = (output.writeChar(reinterpret_cast<const char *>(buffers[next]), size) != ssize_t(size));
+
+            pthread_mutex_lock(&mutex);
+            filled--;
+            stopped = write_failed;
+            pthread_cond_signal(&changed);
+            pthread_mutex_unlock(&mutex);
+            next = (next + 1) % Buffers;
         }
+        pthread_join(reader, NULL);
+
+        if(failed)
+            throw string("Could not read chars");
+        if(write_failed)
+            throw string("Could not write chars");
+        return true;
+    }
+
+    //last value given to Atom::generation; values are never reused, so an index
+    // can't match a tree it was not built for
+    unsigned int last_generation = 0;
+
+    bool byKey(const pair<uint32_t, Atom *> &a, const pair<uint32_t, Atom *> &b) { return a.first < b.first; }
+
+    //at namespace scope: built before main(), so before any thread looks up a definition
+    const DefinitionTable definitions;
 
+    const AtomDefinition &definition(const char *id) {
         if(id) {
-            map<uint32_t, AtomDefinition>::const_iterator it = def.find(id2Key(id));
-            if(it != def.end())
-                return it->second;
+            const AtomDefinition *def = definitions.find(id2Key(id));
+            if(def)
+                return *def;
         }
-        return def_unknown;
+        return KnownAtoms[0];
     }
 }; //namespace
 
 
 
 // Atom
-Atom::Atom() : start(0), length(0), name(""), head(""), version("") { }
+Atom::Arena::Arena(size_t c)
+    : nodes(static_cast<Atom *>(::operator new(c * sizeof(Atom)))), capacity(c), used(0) { }
+
+Atom::Arena::~Arena() {
+    //parents first: they look at their children
+    for(size_t i = 0; i < used; i++)
+        nodes[i].~Atom();
+    ::operator delete(nodes);
+}
+
+Atom *Atom::Arena::take() {
+    if(used == capacity)
+        throw string("Failed reading atom header");
+    Atom *atom = new(nodes + used) Atom;
+    used++;
+    atom->in_arena = true;
+    atom->arena    = this;
+    return atom;
+}
+
+Atom::Atom() : start(0), length(0), name(""), head(""), version(""),
+    arena(NULL), owns_arena(false), in_arena(false), first_child(0), nchildren(0),
+    parent(NULL), generation(nextGeneration()), index_generation(0) { }
 
 Atom::~Atom() {
-    for(unsigned int i = 0; i < children.size(); i++)
-        delete children[i];
+    for(size_t i = 0; i < nchildren; i++) {
+        Atom *atom = child(i);
+        if(!atom->in_arena)
+            delete atom;
+    }
+    if(owns_arena)
+        delete arena;
+}
+
+void Atom::dispose(Atom *atom) {
+    atom->parent = NULL;
+    if(!atom->in_arena) {
+        delete atom;
+        return;
+    }
+    //its node goes with the arena: just give back the content
+    vector<unsigned char>().swap(atom->content);
+}
+
+unsigned int Atom::nextGeneration() {
+    //atoms may be made by more than one thread
+    return __sync_add_and_fetch(&last_generation, 1u);
+}
+
+Atom *Atom::root() {
+    Atom *atom = this;
+    while(atom->parent)
+        atom = atom->parent;
+    return atom;
+}
+
+const Atom *Atom::root() const {
+    const Atom *atom = this;
+    while(atom->parent)
+        atom = atom->parent;
+    return atom;
 }
 
 
@@ -126,12 +359,17 @@ void Atom::parse(File &file) {
     parseHeader(file);
 
     if(isParent(name) && name != string("udta")) { //user data atom is dangerous... i should actually skip all
-        while(file.pos() < start + length) {
-            Atom *atom = new Atom;
-            atom->parse(file);
-            children.push_back(atom);
-        }
-        assert(file.pos() == start + length);
+        //one read for the whole container, then build the children from memory,
+        // all in one arena
+        vector<unsigned char> payload = file.read(length -8);
+        if(payload.size() < length -8)
+            throw string("Failed reading atom content: ") + name;
+        const unsigned char *data = payload.empty() ? NULL : &payload[0];
+        if(owns_arena)
+            delete arena;
+        arena      = new Arena(countParsed(data, payload.size()));
+        owns_arena = true;
+        parseChildren(data, payload.size());
 
     } else {
         content = file.read(length -8); //length includes header
@@ -140,25 +378,96 @@ void Atom::parse(File &file) {
     }
 }
 
+int64_t Atom::parse(const unsigned char *data, int64_t size, int64_t position) {
+    if(size < 8)
+        throw string("Failed reading atom header");
+    start  = position;
+    length = readBE<uint32_t>(data);
+    memcpy(name, data + 4, 4);
+    name[4] = '\0';
+
+    int64_t header = 8;
+    if(length == 1) {
+        if(size < 16)
+            throw string("Failed reading atom header: ") + name;
+        length = readBE<uint64_t>(data + 8) - 8;
+        start += 8;
+        header = 16;
+    } else if(length == 0) {
+        length = size;
+    }
+    if(length < 8 || length - 8 > uint64_t(size - header))
+        throw string("Failed reading atom content: ") + name;
+
+    const unsigned char *payload = data + header;
+    if(!isParent(name) || name == string("udta"))
+        content.assign(payload, payload + (length -8));
+    return header + length -8;
+}
+
+void Atom::parseChildren(const unsigned char *data, int64_t size) {
+    //all the children first, so their links are contiguous, then their children
+    vector<const unsigned char *> payloads;
+    first_child = arena->links.size();
+    nchildren   = 0;
+    int64_t pos = 0;
+    while(pos < size) {
+        Atom *atom = arena->take();     //owned (and freed) by the arena even if parse() throws
+        atom->parent = this;
+        arena->links.push_back(atom);
+        nchildren++;
+        int64_t used = atom->parse(data + pos, size - pos, start + 8 + pos);
+        payloads.push_back(data + pos + used - (atom->length -8));
+        pos += used;
+    }
+    for(size_t i = 0; i < nchildren; i++) {
+        Atom *atom = child(i);
+        if(isParent(atom->name) && atom->name != string("udta"))
+            atom->parseChildren(payloads[i], atom->length -8);
+    }
+    changed();
+}
+
 void Atom::write(File &file) {
     //1 write length
 #ifndef NDEBUG
-    off_t begin = file.pos();
+    int64_t begin = file.pos();
 #endif
 
-    file.writeInt(length);
-    file.writeChar(name, 4);
-    if(!content.empty())
-        file.write(content);
-    for(unsigned int i = 0; i < children.size(); i++)
-        children[i]->write(file);
+    //the whole subtree in one gathered write: headers go to one buffer, content is referenced
+    vector<unsigned char> headers(8 * countAtoms(this));
+    vector<File::Buffer>  buffers;
+    unsigned char *header = &headers[0];
+    gather(file, header, buffers);
+    file.writeBuffers(buffers);
 
 #ifndef NDEBUG
-    off_t end = file.pos();
-    assert(end - begin == length);
+    int64_t end = file.pos();
+    assert(end - begin == int64_t(length));
 #endif
 }
 
+void Atom::gather(File &file, unsigned char *&header, vector<File::Buffer> &buffers) {
+    if(dynamic_cast<BufferedAtom *>(this)) {
+        //content is not in memory: write what we have so far, then let it copy itself
+        file.writeBuffers(buffers);
+        buffers.clear();
+        write(file);
+        return;
+    }
+    writeBE(header, uint32_t(length));
+    memcpy(header + 4, name, 4);
+    File::Buffer buffer = { header, 8 };
+    buffers.push_back(buffer);
+    header += 8;
+    if(!content.empty()) {
+        File::Buffer data = { &content[0], content.size() };
+        buffers.push_back(data);
+    }
+    for(size_t i = 0; i < nchildren; i++)
+        child(i)->gather(file, header, buffers);
+}
+
 void Atom::print(int offset) {
     string indent(offset, ' ');
 
@@ -254,54 +563,92 @@ void Atom::print(int offset) {
 
     }
 
-    for(unsigned int i = 0; i < children.size(); i++)
-        children[i]->print(offset+1);
+    for(size_t i = 0; i < nchildren; i++)
+        child(i)->print(offset+1);
 
     cout.flush();
 }
 
 
 bool Atom::isParent(const char *id) {
-    AtomDefinition def = definition(id);
+    const AtomDefinition &def = definition(id);
     return def.container_state == PARENT_ATOM;// || def.container_state == DUAL_STATE_ATOM;
 }
 
 bool Atom::isDual(const char *id) {
-    AtomDefinition def = definition(id);
+    const AtomDefinition &def = definition(id);
     return def.container_state == DUAL_STATE_ATOM;
 }
 
 bool Atom::isVersioned(const char *id) {
-    AtomDefinition def = definition(id);
+    const AtomDefinition &def = definition(id);
     return def.box_type == VERSIONED_ATOM;
 }
 
 
+void Atom::indexSubtree(vector<IndexEntry> &entries) const {
+    for(size_t i = 0; i < nchildren; i++) {
+        Atom *atom = child(i);
+        entries.push_back(IndexEntry(id2Key(atom->name), atom));
+        atom->indexSubtree(entries);
+    }
+}
+
+pair<vector<Atom::IndexEntry>::const_iterator, vector<Atom::IndexEntry>::const_iterator>
+Atom::lookup(const string &name) const {
+    unsigned int generation = root()->generation;
+    if(index_generation != generation) {
+        index.clear();
+        indexSubtree(index);
+        stable_sort(index.begin(), index.end(), byKey);  //keep depth-first order within a name
+        index_generation = generation;
+    }
+    if(name.size() != 4)
+        return make_pair(index.end(), index.end());
+    return equal_range(index.begin(), index.end(), IndexEntry(id2Key(name.c_str()), NULL), byKey);
+}
+
 vector<Atom *> Atom::atomsByName(string name) const {
     vector<Atom *> atoms;
-    for(unsigned int i = 0; i < children.size(); i++) {
-        if(children[i]->name == name)
-            atoms.push_back(children[i]);
-        vector<Atom *> a = children[i]->atomsByName(name);
-        atoms.insert(atoms.end(), a.begin(), a.end());
-    }
+    pair<vector<IndexEntry>::const_iterator, vector<IndexEntry>::const_iterator> range = lookup(name);
+    for(vector<IndexEntry>::const_iterator it = range.first; it != range.second; ++it)
+        atoms.push_back(it->second);
     return atoms;
 }
 
 Atom *Atom::atomByName(string name) const {
-    for(unsigned int i = 0; i < children.size(); i++) {
-        if(children[i]->name == name)
-            return children[i];
-        Atom *a = children[i]->atomByName(name);
-        if(a) return a;
+    pair<vector<IndexEntry>::const_iterator, vector<IndexEntry>::const_iterator> range = lookup(name);
+    return (range.first != range.second) ? range.first->second : NULL;
+}
+
+void Atom::addChild(Atom *child) {
+    if(!arena) {
+        arena      = new Arena(0);
+        owns_arena = true;
+    }
+    vector<Atom *> &links = arena->links;
+    if(first_child + nchildren != links.size()) {
+        //the range can't grow where it is: move it to the end (the old one is left unused)
+        size_t first = links.size();
+        for(size_t i = 0; i < nchildren; i++) {
+            Atom *link = links[first_child + i];
+            links.push_back(link);
+        }
+        first_child = first;
     }
-    return NULL;
+    links.push_back(child);
+    nchildren++;
+    child->parent = this;
+    changed();
 }
 
 void Atom::replace(Atom *original, Atom *replacement) {
-    for(unsigned int i = 0; i < children.size(); i++) {
-        if(children[i] == original) {
-            children[i] = replacement;
+    for(size_t i = 0; i < nchildren; i++) {
+        if(child(i) == original) {
+            arena->links[first_child + i] = replacement;
+            replacement->parent = this;
+            changed();
+            dispose(original);
             return;
         }
     }
@@ -310,32 +657,34 @@ void Atom::replace(Atom *original, Atom *replacement) {
 
 
 void Atom::prune(string name) {
-    if(children.empty()) return;
+    if(nchildren == 0) return;
+    changed();
 
     length = 8;
 
-    vector<Atom *>::iterator it = children.begin();
-    while(it != children.end()) {
-        Atom *child = *it;
-        if(name == child->name) {
-            delete child;
-            it = children.erase(it);
+    //keep the others in place, in order
+    size_t kept = 0;
+    for(size_t i = 0; i < nchildren; i++) {
+        Atom *atom = child(i);
+        if(name == atom->name) {
+            dispose(atom);
         } else {
-            child->prune(name);
-            length += child->length;
-            ++it;
+            atom->prune(name);
+            length += atom->length;
+            arena->links[first_child + kept++] = atom;
         }
     }
+    nchildren = kept;
 }
 
 void Atom::updateLength() {
     length = 8;
     length += content.size();
 
-    for(unsigned int i = 0; i < children.size(); i++) {
-        Atom *child = children[i];
-        child->updateLength();
-        length += child->length;
+    for(size_t i = 0; i < nchildren; i++) {
+        Atom *atom = child(i);
+        atom->updateLength();
+        length += atom->length;
     }
 }
 
@@ -381,11 +730,17 @@ BufferedAtom::BufferedAtom(string filename)
   : file_begin(0),
     file_end(0),
     buffer(NULL),
+    buffer_capacity(0),
     buffer_begin(0),
-    buffer_end(0)
+    buffer_end(0),
+    advised_end(0)
 {
     if(!file.open(filename))
         throw string("Could not open file");
+    // Serve fragments straight from a read-only mapping when possible,
+    //  falling back to reading into the buffer.
+    if(file.map())
+        file.adviseSequential();
 }
 
 BufferedAtom::~BufferedAtom() {
@@ -393,90 +748,180 @@ BufferedAtom::~BufferedAtom() {
 }
 
 
-unsigned char *BufferedAtom::getFragment(int64_t offset, int64_t size) {
+const unsigned char *BufferedAtom::mappedContent() const {
+    if(!file.isMapped() || file_end > file.mappedSize())
+        return NULL;
+    return file.mapped() + file_begin;
+}
+
+int64_t BufferedAtom::mappedPaddedSize() const {
+    if(!mappedContent())
+        return 0;
+    return max(int64_t(0), min(file_end, int64_t(file.mappedSize()) - FragmentPadding) - file_begin);
+}
+
+const unsigned char *BufferedAtom::getFragment(int64_t offset, int64_t size) {
     assert(size >= 0);
     if(offset < 0)
         throw string("Offset set before beginning of buffer");
     if(offset + size > file_end - file_begin)
         throw string("Out of buffer");
 
-    if(buffer) {
-        if(buffer_begin >= offset && buffer_end >= offset + size)
-            return buffer + (offset - buffer_begin);
+    if(file.isMapped()) {
+        //past the end of the mapping is a SIGBUS, not an error
+        if(file_begin + offset + size > file.mappedSize())
+            throw string("Out of buffer");
+        // Ask the kernel to read ahead of the scan, a stride at a time:
+        //  one madvise() covers the many small reads that follow.
+        if(offset + size > advised_end) {
+            advised_end = min(offset + max(2 * size, int64_t(AdviseStride)), file_end - file_begin);
+            file.adviseWillNeed(file_begin + offset, advised_end - offset);
+        }
+        if(file_begin + offset + size + FragmentPadding <= file.mappedSize())
+            return file.mapped() + file_begin + offset;
+        // Too close to the end of the mapping for the padding: copy into the buffer.
+    }
 
-        //reallocate and reread
+    if(buffer && offset >= buffer_begin && offset + size <= buffer_end)
+        return buffer + (offset - buffer_begin);
+
+    // Forward-only sliding window: the repair scan only moves forward, so keep
+    //  the bytes already read past offset, move them down and read just the tail.
+    int64_t window = 2 * size;
+    if(window < MinWindowSize)
+        window = MinWindowSize;
+    int64_t window_end = offset + window;
+    if(window_end > file_end - file_begin)
+        window_end = file_end - file_begin;
+    if(file.isMapped() && window_end > file.mappedSize() - file_begin)
+        window_end = file.mappedSize() - file_begin;
+
+    int64_t kept = 0;
+    if(buffer && offset >= buffer_begin && offset < buffer_end)
+        kept = buffer_end - offset;
+
+    //allocated even for an empty window: the padding always follows
+    if(!buffer || window_end - offset > buffer_capacity) {
+        unsigned char *grown = new unsigned char[window_end - offset + FragmentPadding];
+        if(kept > 0)
+            memcpy(grown, buffer + (offset - buffer_begin), kept);
         delete[] buffer;
-        buffer = NULL;
+        buffer          = grown;
+        buffer_capacity = window_end - offset;
+    } else if(kept > 0 && offset > buffer_begin) {
+        memmove(buffer, buffer + (offset - buffer_begin), kept);
     }
 
     buffer_begin = offset;
-    buffer_end   = offset + 2 * size;
-    if(buffer_end + file_begin > file_end)
-        buffer_end = file_end - file_begin;
-    buffer = new unsigned char[buffer_end - buffer_begin];
-    file.seek(file_begin + buffer_begin);
-    file.readChar((char *)buffer, buffer_end - buffer_begin);
+    buffer_end   = offset + kept;
+    if(window_end > buffer_end) {
+        if(file.isMapped()) {
+            memcpy(buffer + kept, file.mapped() + file_begin + buffer_end, window_end - buffer_end);
+        } else {
+            file.seek(file_begin + buffer_end);
+            file.readChar((char *)buffer + kept, window_end - buffer_end);
+        }
+        buffer_end = window_end;
+    }
+    memset(buffer + (buffer_end - buffer_begin), 0, FragmentPadding);
     return buffer;
 }
 
+int64_t BufferedAtom::reflinkPadding(File &output, int64_t output_begin) {
+    int64_t block = output.reflinkBlockSize(file);
+    if(block <= 0)
+        return 0;
+    int64_t padding = ((file_begin - output_begin) % block + block) % block;
+    if(padding > 0 && padding < 8)  //a free atom needs at least its header
+        padding += block;
+    return padding;
+}
+
 void BufferedAtom::updateLength() {
     length  = 8;
     length += file_end - file_begin;
 
-    for(unsigned int i = 0; i < children.size(); i++) {
-        Atom *child = children[i];
-        child->updateLength();
-        length += child->length;
+    for(size_t i = 0; i < childCount(); i++) {
+        Atom *atom = child(i);
+        atom->updateLength();
+        length += atom->length;
     }
 }
 
 
 void BufferedAtom::contentResize(size_t newsize) {
-    if(newsize > file_end - file_begin)
+    if(int64_t(newsize) > file_end - file_begin)
         throw string("Cannot resize buffered atom");
 }
 
 
 int32_t BufferedAtom::readInt(int64_t offset) {
-    if(!buffer || offset < buffer_begin || offset > (buffer_end - 4)) {
-        buffer = getFragment(offset, 1<<16);
-    }
-    return readNE<int32_t>(buffer + offset - buffer_begin);
+    return readBE<int32_t>(getFragment(offset, 4));
 }
 
 int64_t BufferedAtom::readInt64(int64_t offset) {
-    if(!buffer || offset < buffer_begin || offset > (buffer_end - 8)) {
-        buffer = getFragment(offset, 1<<16);
-    }
-    return readNE<int64_t>(buffer + offset - buffer_begin);
+    return readBE<int64_t>(getFragment(offset, 8));
 }
 
 
 void BufferedAtom::write(File &output) {
     //1 write length
 #ifndef NDEBUG
-    off_t begin = output.pos();
+    int64_t begin = output.pos();
 #endif
 
-    output.writeInt(length);
-    output.writeChar(name, 4);
-    char buff[1<<20];
-    int64_t offset = file_begin;
-    file.seek(file_begin);
-    while(offset < file_end) {
-        int64_t toread = 1<<20;
-        if(toread + offset > file_end)
-            toread = file_end - offset;
-        file.readChar(buff, toread);
-        offset += toread;
-        output.writeChar(buff, toread);
-    }
-    for(unsigned int i = 0; i < children.size(); i++)
-        children[i]->write(output);
+    if(headerSize() > 8) {
+        output.writeInt(1);
+        output.writeChar(name, 4);
+        output.writeInt64(length + 8);
+    } else {
+        output.writeInt(length);
+        output.writeChar(name, 4);
+    }
+
+    //let the kernel copy (or share) as much as it can
+    int64_t begin_copy = file_begin + output.copyRange(file, file_begin, file_end - file_begin);
+
+    //without copyRange() overlap reading and writing, if that is much (a partial
+    // copyRange() leaves just a tail). Writing straight from a mapping would stall
+    // the write on every page fault.
+    bool copied = false;
+    if(begin_copy == file_begin &&
+            file_end - begin_copy > int64_t(2 * CopyPipeline::BufferSize)) {
+        CopyPipeline pipeline(file, begin_copy, file_end);
+        copied = pipeline.run(output);
+    }
+
+    if(!copied) {
+        if(file.isMapped()) {
+            const char *data = reinterpret_cast<const char *>(file.mapped());
+            for(int64_t offset = begin_copy; offset < file_end; offset += 1<<20) {
+                int64_t towrite = 1<<20;
+                if(towrite + offset > file_end)
+                    towrite = file_end - offset;
+                output.writeChar(data + offset, towrite);
+            }
+        } else {
+            char buff[1<<20];
+            int64_t offset = begin_copy;
+            file.seek(begin_copy);
+            while(offset < file_end) {
+                int64_t toread = 1<<20;
+                if(toread + offset > file_end)
+                    toread = file_end - offset;
+                file.readChar(buff, toread);
+                offset += toread;
+                output.writeChar(buff, toread);
+            }
+        }
+    }
+
+    for(size_t i = 0; i < childCount(); i++)
+        child(i)->write(output);
 
 #ifndef NDEBUG
-    off_t end = output.pos();
-    assert(end - begin == length);
+    int64_t end = output.pos();
+    assert(end - begin == int64_t(length) + headerSize() - 8);
 #endif
 }
 
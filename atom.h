@@ -39,7 +39,6 @@ public:
     char    head[4];
     char    version[4];
     std::vector<unsigned char> content;
-    std::vector<Atom *> children;
 
     Atom();
     virtual ~Atom();
@@ -51,6 +50,12 @@ public:
 
     std::vector<Atom *> atomsByName(std::string name) const;
     Atom *              atomByName (std::string name) const;
+
+    //change children with addChild(), replace() and prune(): they keep lookups current
+    size_t childCount() const { return nchildren; }
+    Atom  *child(size_t i) const { return arena->links[first_child + i]; }
+    void addChild(Atom *child);
+    //replace the child original, which is deleted
     void replace(Atom *original, Atom *replacement);
 
     void prune(std::string name);
@@ -69,7 +74,58 @@ public:
     void writeInt64(int64_t value, int64_t offset);
     void readChar(char *str, int64_t offset, int64_t length);
 
+protected:
+    //parse from memory (position: of data in the file); returns the bytes used.
+    // Children are left to parseChildren(): data is where their content is.
+    int64_t parse(const unsigned char *data, int64_t size, int64_t position);
+    void    parseChildren(const unsigned char *data, int64_t size);
+
 private:
+    //the atoms of a parsed tree, in one block, and the links from every atom of the
+    // tree to its children: a contiguous range for each atom
+    struct Arena {
+        Atom               *nodes;      //parents before their children
+        size_t              capacity;
+        size_t              used;
+        std::vector<Atom *> links;
+
+        explicit Arena(size_t capacity);
+        ~Arena();
+        Atom *take();                   //the next unused node
+
+    private:
+        Arena(const Arena&);
+        Arena& operator=(const Arena&);
+    };
+
+    Arena                          *arena;          //has the links to the children (NULL: none yet)
+    bool                            owns_arena;     //made for this atom: by parse() or the first addChild()
+    bool                            in_arena;       //one of the nodes of an arena: freed with it
+    size_t                          first_child;    //children are arena->links[first_child, first_child + nchildren)
+    size_t                          nchildren;
+
+    Atom                           *parent;         //NULL for the root of a tree
+    unsigned int                    generation;     //root only: changes with every change to its tree
+
+    //(FourCC, atom) for the whole subtree, sorted by FourCC and then depth-first;
+    // built by the first lookup after a change to the tree
+    typedef std::pair<uint32_t, Atom *> IndexEntry;
+    mutable std::vector<IndexEntry> index;
+    mutable unsigned int            index_generation;
+
+    Atom *root();
+    const Atom *root() const;
+    void  changed() { root()->generation = nextGeneration(); }
+    static unsigned int nextGeneration();
+    void indexSubtree(std::vector<IndexEntry> &entries) const;
+    //for an atom out of its tree
+    static void dispose(Atom *atom);
+    //add headers and content of the subtree to buffers (for one writeBuffers())
+    void gather(File &file, unsigned char *&header, std::vector<File::Buffer> &buffers);
+    //entries with this name
+    std::pair<std::vector<IndexEntry>::const_iterator, std::vector<IndexEntry>::const_iterator>
+        lookup(const std::string &name) const;
+
     // Disable copying (BufferedAtom can't be copied, so children can't either).
     Atom(const Atom&);
     Atom& operator=(const Atom&);
@@ -85,10 +141,23 @@ public:
     ~BufferedAtom();
 
     virtual void write(File &file);
-
-    unsigned char *getFragment(int64_t offset, int64_t size);
+    //bytes write() puts in front of the content: 16 when the size needs 64 bits
+    int64_t headerSize() const { return (length > 0xffffffffULL) ? 16 : 8; }
+
+    //decoders read a little past the data they are given (AV_INPUT_BUFFER_PADDING_SIZE):
+    // a fragment is followed by at least this many readable bytes, zeros past the content
+    static const int64_t FragmentPadding = 64;
+
+    const unsigned char *getFragment(int64_t offset, int64_t size);
+    //whole content when the file is mapped (NULL otherwise); unlike getFragment safe to share between threads.
+    // Only its first mappedPaddedSize() bytes are followed by FragmentPadding readable bytes.
+    const unsigned char *mappedContent() const;
+    int64_t mappedPaddedSize() const;
     virtual void updateLength();
 
+    //padding before the content at output_begin so write() can reflink it (0 if not possible)
+    int64_t reflinkPadding(File &output, int64_t output_begin);
+
     virtual int64_t contentSize() const { return file_end - file_begin; }
     virtual void    contentResize(size_t newsize);   //can't actually resize!
 
@@ -96,10 +165,17 @@ public:
     virtual int64_t readInt64(int64_t offset);
 
 protected:
+    // Smallest amount read at once when the file is not mapped.
+    static const int64_t MinWindowSize = 1<<17;
+    // Read-ahead asked of the kernel at once, ahead of the reads (mapped file).
+    static const int64_t AdviseStride = 8<<20;
+
     File            file;
     unsigned char  *buffer;
+    int64_t         buffer_capacity;    //content bytes; FragmentPadding more are allocated
     int64_t         buffer_begin;
     int64_t         buffer_end;
+    int64_t         advised_end;    //read-ahead requested up to here (mapped file)
 
 private:
     // Disable copying (File can't be copied).
@@ -0,0 +1,67 @@
+//==================================================================//
+/*
+    Untrunc - byteorder.h
+
+    Untrunc is GPL software; you can freely distribute,
+    redistribute, modify & use under the terms of the GNU General
+    Public License; either version 2 or its successor.
+
+    Untrunc is distributed under the GPL "AS IS", without
+    any warranty; without the implied warranty of merchantability
+    or fitness for either an expressed or implied particular purpose.
+
+    Please see the included GNU General Public License (GPL) for
+    your rights and further details; see the file COPYING. If you
+    cannot, write to the Free Software Foundation, 59 Temple Place
+    Suite 330, Boston, MA 02111-1307, USA.  Or www.fsf.org
+
+    Copyright 2010 Federico Ponchio
+                                                                    */
+//==================================================================//
+
+#ifndef BYTEORDER_H
+#define BYTEORDER_H
+
+extern "C" {
+#include <stdint.h>
+}
+#include <cstddef>
+#include <cstring>      //for: memcpy()
+
+
+// Read an unaligned, big-endian value.
+// A compiler will optimize this (at -O2) to a single instruction if possible.
+template<class T>
+inline T readBE(const uint8_t *p, size_t i = 0) {
+    return (i >= sizeof(T)) ? T(0) :
+            (T(*p) << ((sizeof(T) - 1 - i) * 8)) | readBE<T>(p + 1, i + 1);
+}
+
+template<class T>
+inline void readBE(T &result, const uint8_t *p) { result = readBE<T>(p); }
+
+// Write an unaligned, big-endian value.
+template<class T>
+inline void writeBE(uint8_t *p, T value, size_t i = 0) {
+    (i >= sizeof(T)) ? void(0) :
+        (*p = ((value >> ((sizeof(T) - 1 - i) * 8)) & 0xFF) , writeBE(p + 1, value, i + 1));
+}
+
+// Read an unaligned value in native-endian format.
+// Encode the unaligned access intention by using memcpy() with its
+//  destination and source pointing to types with the wanted alignment.
+// Some compilers use the alignments of these types for further optimizations.
+// A compiler can optimize this memcpy() into a single instruction.
+template<class T>
+inline T readNE(const uint8_t *p) {
+    T value;
+    memcpy(&value, p, sizeof(value));
+    return value;
+}
+
+template<class T>
+inline void readNE(T &result, const uint8_t *p) {
+    memcpy(&result, p, sizeof(result));
+}
+
+#endif // BYTEORDER_H
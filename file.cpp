@@ -25,6 +25,30 @@
 #include <string>
 #include <cstdio>
 #include <cassert>
+#include <cstdlib>
+#include <cstring>
+#include <limits>
+#include <algorithm>
+
+#if defined(_WIN32)
+extern "C" {
+# include <io.h>        // for: _chsize_s()
+}
+#else
+extern "C" {
+# include <sys/mman.h>  // for: mmap(), madvise()
+# include <sys/stat.h>  // for: fstat()
+# include <fcntl.h>     // for: open(), fcntl()
+# include <unistd.h>    // for: sysconf(), ftruncate(), copy_file_range()
+# include <sys/uio.h>   // for: writev()
+# include <limits.h>    // for: IOV_MAX
+#if defined(__linux__)
+# include <sys/ioctl.h>
+# include <sys/vfs.h>   // for: fstatfs()
+# include <linux/fs.h>  // for: FICLONERANGE
+#endif
+}
+#endif
 
 using namespace std;
 
@@ -56,21 +80,121 @@ uint64_t swap64(uint64_t ull) {
 #define FILE_SIZE_UPDATE_ON_WRITE   1
 // Seek from end-of-file when seeking to a negative offset.
 //#define FILE_SEEK_FROM_END          1
+// Memory map read-only files, if supported.
+#if !defined(_WIN32) && defined(MAP_FAILED)
+# define FILE_USE_MMAP              1
+#endif
+// Copy between files inside the kernel (glibc 2.27 and later).
+#if defined(__linux__) && defined(__GLIBC_PREREQ)
+# if __GLIBC_PREREQ(2, 27)
+#  define FILE_USE_COPY_RANGE       1
+# endif
+#endif
+// Gather writes of many small buffers into one system call.
+#if !defined(_WIN32) && defined(IOV_MAX)
+# define FILE_USE_WRITEV            1
+#endif
+// Raw file descriptors with pread()/pwrite() as alternative backend.
+#if !defined(_WIN32)
+# define FILE_USE_RAW_IO            1
+#endif
+// Direct I/O for created files of the raw backend.
+#if defined(FILE_USE_RAW_IO) && defined(__linux__) && defined(O_DIRECT)
+# define FILE_USE_DIRECT_IO         1
+#endif
+// Share extents between files on filesystems that support it.
+#if defined(__linux__) && defined(FICLONERANGE)
+# define FILE_USE_REFLINK           1
+#endif
+
+
+namespace {
+	// Raw backend: read-ahead and write-behind sizes.
+	const size_t RawReadSize   = 1 << 20;
+	const size_t RawWriteSize  = 8 << 20;
+	// Reads and writes this large bypass the buffers (not with direct I/O).
+	const size_t RawBypassSize = 1 << 20;
+	// Alignment of the buffers, for direct I/O.
+	const size_t RawAlign     = 4096;
+
+	unsigned char *allocBuffer(size_t size) {
+#ifdef FILE_USE_RAW_IO
+		void *p = NULL;
+		if(posix_memalign(&p, RawAlign, size) != 0)
+			return NULL;
+		return static_cast<unsigned char*>(p);
+#else
+		return static_cast<unsigned char*>(malloc(size));
+#endif
+	}
+}
 
 
 // Encapsulate FILE (RAII).
-File::File() : file(NULL), file_sz(-1) { }
+bool File::raw_io    = false;
+bool File::direct_io = false;
+
+File::File()
+	: file(NULL), file_sz(-1), map_data(NULL), map_sz(0),
+	  fd(-1), direct(false), fd_pos(0),
+	  read_buf(NULL), read_begin(0), read_size(0),
+	  write_buf(NULL), write_begin(0), write_size(0) { }
 
 File::~File() {
 	close();
 }
 
 
+bool File::setRawIo(bool raw, bool direct) {
+#ifdef FILE_USE_RAW_IO
+	raw_io    = raw;
+# ifdef FILE_USE_DIRECT_IO
+	direct_io = raw && direct;
+	return true;
+# else
+	direct_io = false;
+	return !direct;
+# endif
+#else
+	raw_io    = false;
+	direct_io = false;
+	return !raw;
+#endif
+}
+
+bool File::openRaw(const string &filename, int flags) {
+#ifdef FILE_USE_RAW_IO
+	fd = ::open(filename.c_str(), flags, 0666);
+	if(fd < 0)
+		return false;
+	struct stat st;
+	if(fstat(fd, &st) != 0) {
+		close();
+		return false;
+	}
+	file_sz = st.st_size;
+	fd_pos  = 0;
+# ifdef FILE_USE_DIRECT_IO
+	direct  = (flags & O_DIRECT) != 0;
+# endif
+	return true;
+#else
+	(void)filename;
+	(void)flags;
+	return false;
+#endif
+}
+
+
 bool File::open(string filename) {
 	close();
 
 	if(filename.empty())
 		return false;
+#ifdef FILE_USE_RAW_IO
+	if(raw_io)
+		return openRaw(filename, O_RDONLY);
+#endif
 	file = fopen(filename.c_str(), "rb");
 	if(!file)
 		return false;
@@ -89,6 +213,16 @@ bool File::create(string filename) {
 
 	if(filename.empty())
 		return false;
+#ifdef FILE_USE_RAW_IO
+	if(raw_io) {
+		int flags = O_WRONLY | O_CREAT | O_TRUNC;
+# ifdef FILE_USE_DIRECT_IO
+		if(direct_io)
+			flags |= O_DIRECT;
+# endif
+		return openRaw(filename, flags);
+	}
+#endif
 	file = fopen(filename.c_str(), "wb");
 	if(!file)
 		return false;
@@ -99,21 +233,196 @@ bool File::create(string filename) {
 	return true;
 }
 
-void File::close() {
+bool File::openReadWrite(string filename) {
+	close();
+
+	if(filename.empty())
+		return false;
+#ifdef FILE_USE_RAW_IO
+	if(raw_io)
+		return openRaw(filename, O_RDWR);
+#endif
+	file = fopen(filename.c_str(), "r+b");
+	if(!file)
+		return false;
+
+	fseeko(file, 0L, SEEK_END);
+	off_t sz = ftello(file);
+	fseeko(file, 0L, SEEK_SET);
+	if(sz < 0)
+		return false;
+	file_sz = sz;
+	return true;
+}
+
+bool File::flush() {
+	if(file)
+		return fflush(file) == 0;
+	return fd < 0 || flushWrites();
+}
+
+bool File::close() {
+	bool ok = true;
+	unmap();
 	if(file) {
 		FILE *rm_file = file;
 		file = NULL;
-		fclose(rm_file);
+		if(fclose(rm_file) != 0)
+			ok = false;
+	}
+#ifdef FILE_USE_RAW_IO
+	if(fd >= 0) {
+		if(!flushWrites())
+			ok = false;
+		if(::close(fd) != 0)
+			ok = false;
+		fd = -1;
 	}
+#endif
+	free(read_buf);
+	free(write_buf);
+	read_buf   = NULL;
+	write_buf  = NULL;
+	read_size  = 0;
+	write_size = 0;
+	direct     = false;
+	fd_pos     = 0;
 	file_sz = -1;
+	return ok;
+}
+
+int File::descriptor() {
+	if(fd >= 0) {
+		flushWrites();
+		return fd;
+	}
+	return (file) ? fileno(file) : -1;
+}
+
+bool File::flushWrites() {
+#ifdef FILE_USE_RAW_IO
+	if(write_size == 0)
+		return true;
+# ifdef FILE_USE_DIRECT_IO
+	// Direct I/O wants an aligned position and size: write the rest through the page cache.
+	bool unaligned = direct && (write_begin % RawAlign != 0 || write_size % RawAlign != 0);
+	if(unaligned)
+		fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_DIRECT);
+# endif
+	const unsigned char *p = write_buf;
+	size_t left = write_size;
+	off_t  at   = write_begin;
+	while(left > 0) {
+		ssize_t n = pwrite(fd, p, left, at);
+		if(n <= 0)
+			break;
+		p    += n;
+		left -= n;
+		at   += n;
+	}
+# ifdef FILE_USE_DIRECT_IO
+	if(unaligned)
+		fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_DIRECT);
+# endif
+	write_size = 0;
+	return left == 0;
+#else
+	return true;
+#endif
+}
+
+size_t File::readRaw(void *dest, size_t n) {
+#ifdef FILE_USE_RAW_IO
+	// Reads must see what was written.
+	if(write_size > 0 && !flushWrites())
+		return 0;
+	unsigned char *out  = static_cast<unsigned char*>(dest);
+	size_t         done = 0;
+	while(done < n) {
+		if(fd_pos >= read_begin && fd_pos < read_begin + off_t(read_size)) {
+			size_t part = min(n - done, size_t(read_begin + off_t(read_size) - fd_pos));
+			memcpy(out + done, read_buf + (fd_pos - read_begin), part);
+			done   += part;
+			fd_pos += part;
+			continue;
+		}
+		if(n - done >= RawBypassSize) {
+			ssize_t got = pread(fd, out + done, n - done, fd_pos);
+			if(got <= 0)
+				break;
+			done   += got;
+			fd_pos += got;
+			continue;
+		}
+		if(!read_buf && !(read_buf = allocBuffer(RawReadSize)))
+			break;
+		ssize_t got = pread(fd, read_buf, RawReadSize, fd_pos);
+		read_begin = fd_pos;
+		read_size  = (got > 0) ? size_t(got) : 0;
+		if(got <= 0)
+			break;
+	}
+	return done;
+#else
+	(void)dest;
+	(void)n;
+	return 0;
+#endif
+}
+
+ssize_t File::writeRaw(const void *source, size_t n) {
+#ifdef FILE_USE_RAW_IO
+	read_size = 0;      // The read-ahead may be stale now.
+	// Pending writes must end where this one starts.
+	if(write_size > 0 && write_begin + off_t(write_size) != fd_pos && !flushWrites())
+		return -1;
+	const unsigned char *in   = static_cast<const unsigned char*>(source);
+	size_t               done = 0;
+	while(done < n) {
+		if(write_size == 0 && n - done >= RawBypassSize && !direct) {
+			ssize_t put = pwrite(fd, in + done, n - done, fd_pos);
+			if(put <= 0)
+				break;
+			done   += put;
+			fd_pos += put;
+			continue;
+		}
+		if(!write_buf && !(write_buf = allocBuffer(RawWriteSize)))
+			break;
+		if(write_size == 0)
+			write_begin = fd_pos;
+		size_t part = min(n - done, RawWriteSize - write_size);
+		memcpy(write_buf + write_size, in + done, part);
+		write_size += part;
+		done       += part;
+		fd_pos     += part;
+		if(write_size == RawWriteSize && !flushWrites())
+			return -1;
+	}
+	if(file_sz < fd_pos)
+		file_sz = fd_pos;
+	return done;
+#else
+	(void)source;
+	(void)n;
+	return -1;
+#endif
 }
 
 
 off_t File::pos() {
+	if(fd >= 0)
+		return fd_pos;
 	return (file) ? ftello(file) : off_t(-1);
 }
 
 void File::seek(off_t offset) {
+	if(fd >= 0) {
+		assert(offset >= 0);
+		if(offset >= 0)
+			fd_pos = offset;
+		return;
+	}
 #ifdef FILE_SEEK_FROM_END
 	if(file)
 		fseeko(file, offset, (offset >= 0) ? SEEK_SET : SEEK_END);
@@ -125,6 +434,8 @@ void File::seek(off_t offset) {
 }
 
 void File::rewind() {
+	if(fd >= 0)
+		fd_pos = 0;
 	if(file) {
 		fseeko(file, 0L, SEEK_SET);
 		clearerr(file);
@@ -132,6 +443,8 @@ void File::rewind() {
 }
 
 bool File::atEnd() {
+	if(fd >= 0)
+		return fd_pos >= file_sz;
 	if(!file)
 		return true;
 	off_t pos = ftello(file);
@@ -149,6 +462,8 @@ bool File::atEnd() {
 }
 
 off_t File::size() {
+	if(fd >= 0)
+		return file_sz;
 #ifdef FILE_SIZE_UPDATE_ON_WRITE
 	return file_sz;
 #else
@@ -168,10 +483,30 @@ off_t File::size() {
 #endif
 }
 
+bool File::truncate(off_t length) {
+	if(!*this || length < 0)
+		return false;
+	if(file && fflush(file) != 0)
+		return false;
+	if(fd >= 0 && !flushWrites())
+		return false;
+	read_size = 0;
+#ifdef _WIN32
+	if(_chsize_s(_fileno(file), length) != 0)
+		return false;
+#else
+	if(ftruncate(descriptor(), length) != 0)
+		return false;
+#endif
+	file_sz = length;
+	return true;
+}
+
 
 uint32_t File::readInt() {
 	uint32_t value = 0;
-	size_t n = (file) ? fread(&value, sizeof(value), 1, file) : 0;
+	size_t n = (fd >= 0) ? size_t(readRaw(&value, sizeof(value)) == sizeof(value))
+						 : (file) ? fread(&value, sizeof(value), 1, file) : 0;
 	if(n != 1)
 		throw string("Could not read atom length");
 
@@ -183,7 +518,8 @@ uint32_t File::readInt() {
 
 uint64_t File::readInt64() {
 	uint64_t value = 0;
-	size_t n = (file) ? fread(&value, sizeof(value), 1, file) : 0;
+	size_t n = (fd >= 0) ? size_t(readRaw(&value, sizeof(value)) == sizeof(value))
+						 : (file) ? fread(&value, sizeof(value), 1, file) : 0;
 	if(n != 1)
 		throw string("Could not read atom length");
 
@@ -197,7 +533,7 @@ uint64_t File::readInt64() {
 void File::readChar(char *dest, size_t n) {
 	assert(dest != NULL || n == 0);
 	if(n > 0) {
-		size_t len = fread(dest, sizeof(char), n, file);
+		size_t len = (fd >= 0) ? readRaw(dest, n) : fread(dest, sizeof(char), n, file);
 		if(len != n)
 			throw string("Could not read chars");
 	}
@@ -206,7 +542,7 @@ void File::readChar(char *dest, size_t n) {
 vector<unsigned char> File::read(size_t n) {
 	vector<unsigned char> dest(n);
 	if(n > 0) {
-		size_t len = fread(&dest[0], sizeof(unsigned char), n, file);
+		size_t len = (fd >= 0) ? readRaw(&dest[0], n) : fread(&dest[0], sizeof(unsigned char), n, file);
 		if(len != n)
 			throw string("Could not read at position");
 	}
@@ -215,7 +551,7 @@ vector<unsigned char> File::read(size_t n) {
 
 
 ssize_t File::writeInt(int32_t value) {
-	if(!file)
+	if(!*this)
 		return -1;
 
 	// Write a 32-bit big-endian value.
@@ -228,6 +564,8 @@ ssize_t File::writeInt(int32_t value) {
 		static_cast<uint8_t>(val32)
 	};
 
+	if(fd >= 0)
+		return (writeRaw(data, sizeof(data)) == ssize_t(sizeof(data))) ? 1 : -1;
 	size_t len = fwrite(&data, sizeof(data), 1, file);
 	if(len == 0)
 		return (ferror(file)) ? -1 : 0;
@@ -240,7 +578,7 @@ ssize_t File::writeInt(int32_t value) {
 }
 
 ssize_t File::writeInt64(int64_t value) {
-	if(!file)
+	if(!*this)
 		return -1;
 
 	// Write a 64-bit big-endian value.
@@ -257,6 +595,8 @@ ssize_t File::writeInt64(int64_t value) {
 		static_cast<uint8_t>(val64)
 	};
 
+	if(fd >= 0)
+		return (writeRaw(data, sizeof(data)) == ssize_t(sizeof(data))) ? 1 : -1;
 	size_t len = fwrite(&data, sizeof(data), 1, file);
 	if(len == 0)
 		return (ferror(file)) ? -1 : 0;
@@ -272,6 +612,8 @@ ssize_t File::writeChar(const char *source, size_t n) {
 	assert(source != NULL || n == 0);
 	if(n == 0)
 		return  0;
+	if(fd >= 0)
+		return writeRaw(source, n);
 	if(!file)
 		return -1;
 
@@ -289,6 +631,8 @@ ssize_t File::writeChar(const char *source, size_t n) {
 ssize_t File::write(vector<unsigned char> &v) {
 	if(v.empty())
 		return  0;
+	if(fd >= 0)
+		return writeRaw(&v[0], v.size());
 	if(!file)
 		return -1;
 
@@ -303,3 +647,271 @@ ssize_t File::write(vector<unsigned char> &v) {
 	return len;
 }
 
+
+ssize_t File::writeBuffers(const vector<Buffer> &buffers) {
+	if(fd >= 0) {
+		// Gathered by the write-behind buffer.
+		ssize_t written = 0;
+		for(size_t i = 0; i < buffers.size(); i++) {
+			ssize_t n = writeRaw(buffers[i].data, buffers[i].size);
+			if(n < 0)
+				return -1;
+			written += n;
+		}
+		return written;
+	}
+	if(!file)
+		return -1;
+#ifdef FILE_USE_WRITEV
+	// Our own buffered writes must reach the file first.
+	if(fflush(file) != 0)
+		return -1;
+	off_t begin = ftello(file);
+	if(begin < 0)
+		return -1;
+
+	int     out_fd  = fileno(file);
+	ssize_t written = 0;
+	size_t  next    = 0;    // First buffer not completely written.
+	size_t  skip    = 0;    // Bytes of it already written.
+	vector<struct iovec> iov;
+	while(next < buffers.size()) {
+		iov.clear();
+		for(size_t i = next; i < buffers.size() && iov.size() < size_t(IOV_MAX); i++) {
+			if(buffers[i].size == 0)
+				continue;
+			struct iovec v;
+			v.iov_base = const_cast<char *>(static_cast<const char *>(buffers[i].data));
+			v.iov_len  = buffers[i].size;
+			if(i == next) {
+				v.iov_base = static_cast<char *>(v.iov_base) + skip;
+				v.iov_len -= skip;
+			}
+			iov.push_back(v);
+		}
+		if(iov.empty())
+			break;
+		ssize_t n = writev(out_fd, &iov[0], iov.size());
+		if(n <= 0)
+			break;
+		written += n;
+		// Move past what was written (possibly part of a buffer).
+		size_t left = size_t(n) + skip;
+		while(next < buffers.size() && left >= buffers[next].size) {
+			left -= buffers[next].size;
+			next++;
+		}
+		skip = left;
+	}
+
+	fseeko(file, begin + written, SEEK_SET);
+#ifdef FILE_SIZE_UPDATE_ON_WRITE
+	if(file_sz < begin + written)
+		file_sz = begin + written;
+#endif
+	return written;
+#else
+	ssize_t written = 0;
+	for(size_t i = 0; i < buffers.size(); i++) {
+		if(buffers[i].size == 0)
+			continue;
+		size_t len = fwrite(buffers[i].data, 1, buffers[i].size, file);
+		written += len;
+		if(len != buffers[i].size)
+			break;
+	}
+#ifdef FILE_SIZE_UPDATE_ON_WRITE
+	off_t  pos = ftello(file);
+	if(file_sz < pos)
+		file_sz = pos;
+#endif
+	return written;
+#endif
+}
+
+
+
+// Map the whole file read-only into memory.
+// Fails (and leaves the stdio interface as the only access path) when
+//  the platform has no mmap() or the address space is too small.
+bool File::map() {
+#ifdef FILE_USE_MMAP
+	if(map_data)
+		return true;
+	if(!*this || file_sz <= 0)
+		return false;
+	if(uint64_t(file_sz) > uint64_t(numeric_limits<size_t>::max()))
+		return false;
+
+	void *p = mmap(NULL, size_t(file_sz), PROT_READ, MAP_PRIVATE, descriptor(), 0);
+	if(p == MAP_FAILED)
+		return false;
+	map_data = static_cast<unsigned char*>(p);
+	map_sz   = file_sz;
+	return true;
+#else
+	return false;
+#endif
+}
+
+void File::unmap() {
+#ifdef FILE_USE_MMAP
+	if(map_data) {
+		munmap(map_data, size_t(map_sz));
+		map_data = NULL;
+		map_sz   = 0;
+	}
+#endif
+}
+
+void File::adviseSequential() {
+#if defined(FILE_USE_MMAP) && defined(MADV_SEQUENTIAL)
+	if(map_data)
+		madvise(map_data, size_t(map_sz), MADV_SEQUENTIAL);
+#endif
+}
+
+void File::adviseWillNeed(off_t offset, off_t length) {
+#if defined(FILE_USE_MMAP) && defined(MADV_WILLNEED)
+	if(!map_data || offset < 0 || offset >= map_sz || length <= 0)
+		return;
+	if(length > map_sz - offset)
+		length = map_sz - offset;
+
+	// madvise() wants a page aligned address.
+	//  (Not a static: sysconf() is cheap, and this runs in worker threads.)
+	const off_t page_sz = sysconf(_SC_PAGESIZE);
+	off_t begin = offset - offset % page_sz;
+	madvise(map_data + begin, size_t(offset + length - begin), MADV_WILLNEED);
+#else
+	(void)offset;
+	(void)length;
+#endif
+}
+
+
+off_t File::copyRange(File &source, off_t offset, off_t length) {
+#if defined(FILE_USE_COPY_RANGE) || defined(FILE_USE_REFLINK)
+	if(!*this || !source || offset < 0 || length <= 0)
+		return 0;
+	// Our own writes must reach the file before the kernel appends to it.
+	if(file && fflush(file) != 0)
+		return 0;
+	off_t out_begin = pos();
+	if(out_begin < 0)
+		return 0;
+
+	int   in_fd  = source.descriptor();
+	int   out_fd = descriptor();
+	off_t done   = 0;
+
+#ifdef FILE_USE_REFLINK
+	// Clone the block aligned middle part of the range.
+	// Source and destination must share the same alignment within a block.
+	off_t block = reflinkBlockSize(source);
+	off_t head  = 0;
+	off_t body  = 0;
+	if(block > 0 && (offset - out_begin) % block == 0) {
+		head = (block - offset % block) % block;
+		body = (length > head) ? (length - head) / block * block : 0;
+		struct file_clone_range range;
+		range.src_fd      = in_fd;
+		range.src_offset  = offset + head;
+		range.src_length  = body;
+		range.dest_offset = out_begin + head;
+		if(body <= 0 || ioctl(out_fd, FICLONERANGE, &range) != 0)
+			body = 0;
+	}
+#endif
+
+#ifdef FILE_USE_COPY_RANGE
+	while(done < length) {
+		loff_t in_off  = offset + done;
+		loff_t out_off = out_begin + done;
+		off_t  todo    = length - done;
+#ifdef FILE_USE_REFLINK
+		// Skip over the cloned part once the head is in place.
+		if(body > 0 && done == head) {
+			done += body;
+			continue;
+		}
+		if(body > 0 && done < head)
+			todo = head - done;
+#endif
+		ssize_t n = copy_file_range(in_fd, &in_off, out_fd, &out_off, todo, 0);
+		if(n <= 0)
+			break;  // EXDEV, ENOSYS, EINVAL...: the caller copies the rest.
+		done += n;
+	}
+#elif defined(FILE_USE_REFLINK)
+	// No copy_file_range(): write the head ourselves, so the cloned body counts as done.
+	if(body > 0) {
+		vector<unsigned char> buf(head);
+# ifdef FILE_USE_DIRECT_IO
+		if(direct)
+			fcntl(out_fd, F_SETFL, fcntl(out_fd, F_GETFL) & ~O_DIRECT);
+# endif
+		off_t copied = 0;
+		while(copied < head) {
+			ssize_t n = pread(in_fd, &buf[copied], head - copied, offset + copied);
+			if(n <= 0)
+				break;
+			ssize_t put = pwrite(out_fd, &buf[copied], n, out_begin + copied);
+			if(put != n)
+				break;
+			copied += n;
+		}
+# ifdef FILE_USE_DIRECT_IO
+		if(direct)
+			fcntl(out_fd, F_SETFL, fcntl(out_fd, F_GETFL) | O_DIRECT);
+# endif
+		if(copied == head)
+			done = head + body;     // The caller writes the tail.
+	}
+#endif
+
+	if(fd >= 0) {
+		fd_pos    = out_begin + done;
+		read_size = 0;
+		if(file_sz < fd_pos)
+			file_sz = fd_pos;
+		return done;
+	}
+	fseeko(file, out_begin + done, SEEK_SET);
+#ifdef FILE_SIZE_UPDATE_ON_WRITE
+	if(file_sz < out_begin + done)
+		file_sz = out_begin + done;
+#endif
+	return done;
+#else
+	(void)source;
+	(void)offset;
+	(void)length;
+	return 0;
+#endif
+}
+
+off_t File::reflinkBlockSize(File &source) {
+#ifdef FILE_USE_REFLINK
+	if(!*this || !source)
+		return 0;
+	struct stat in_st, out_st;
+	if(fstat(source.descriptor(), &in_st) != 0 || fstat(descriptor(), &out_st) != 0)
+		return 0;
+	if(in_st.st_dev != out_st.st_dev)
+		return 0;
+
+	// Only filesystems known to implement FICLONERANGE.
+	struct statfs fs;
+	if(fstatfs(descriptor(), &fs) != 0)
+		return 0;
+	const unsigned long Btrfs = 0x9123683E;
+	const unsigned long Xfs   = 0x58465342;
+	if(static_cast<unsigned long>(fs.f_type) != Btrfs && static_cast<unsigned long>(fs.f_type) != Xfs)
+		return 0;
+	return out_st.st_blksize;
+#else
+	(void)source;
+	return 0;
+#endif
+}
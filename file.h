@@ -37,15 +37,28 @@ uint64_t swap64(uint64_t ull);
 
 
 // Encapsulate FILE (RAII).
+// Alternatively (see setRawIo()) a file descriptor used with pread()/pwrite()
+//  through large read-ahead and write-behind buffers of our own.
 class File {
 public:
 	File();
 	~File();
 
+	// Backend of the files opened from now on: stdio (default) or raw descriptors.
+	// Direct I/O (O_DIRECT) applies to created files, so copies bypass the page cache.
+	// Returns false if not supported on this platform.
+	static bool setRawIo(bool raw, bool direct = false);
+
 	bool open  (std::string filename);
 	bool create(std::string filename);
+	bool openReadWrite(std::string filename);
+
+	operator bool() { return file != NULL || fd >= 0; }
 
-	operator bool() { return static_cast<bool>(file); }
+	// Push buffered writes to the system; false if they could not be written.
+	bool flush();
+	// False if pending writes or closing the file failed (the destructor ignores it).
+	bool close();
 
 	off_t pos();
 	void  seek(off_t offset);
@@ -53,6 +66,7 @@ public:
 	bool  atEnd();
 	off_t size();
 	off_t length() { return size(); }
+	bool  truncate(off_t length);
 
 	uint32_t readInt();
 	uint64_t readInt64();
@@ -64,11 +78,55 @@ public:
 	ssize_t writeChar (const char *source, size_t n);
 	ssize_t write(std::vector<unsigned char> &v);
 
+	// Write several buffers, in order, with as few system calls as possible (writev).
+	struct Buffer {
+		const void *data;
+		size_t      size;
+	};
+	ssize_t writeBuffers(const std::vector<Buffer> &buffers);
+
+	// Map the whole (read-only) file into memory.
+	bool map();
+	void unmap();
+	bool isMapped() const { return map_data != NULL; }
+	const unsigned char *mapped() const { return map_data; }
+	off_t mappedSize() const { return map_sz; }
+	// Access pattern hints for the mapping.
+	void adviseSequential();
+	void adviseWillNeed(off_t offset, off_t length);
+
+	// Copy a range of source to the current position without passing the data
+	//  through user space (reflink or copy_file_range).
+	// Returns the number of bytes copied; the caller copies the rest.
+	off_t copyRange(File &source, off_t offset, off_t length);
+	// Block size at which source ranges can be shared by a reflink, 0 if unsupported.
+	off_t reflinkBlockSize(File &source);
+
 protected:
 	std::FILE *file;
 	off_t file_sz;
-
-	void close();
+	unsigned char *map_data;
+	off_t map_sz;
+
+	// Raw backend.
+	int   fd;               // -1 when using stdio.
+	bool  direct;           // Opened with O_DIRECT.
+	off_t fd_pos;
+	unsigned char *read_buf;    // Read-ahead window [read_begin, read_begin + read_size).
+	off_t          read_begin;
+	size_t         read_size;
+	unsigned char *write_buf;   // Pending writes at [write_begin, write_begin + write_size).
+	off_t          write_begin;
+	size_t         write_size;
+
+	static bool raw_io;
+	static bool direct_io;
+
+	int  descriptor();      // Of either backend; pending raw writes are flushed.
+	bool openRaw(const std::string &filename, int flags);
+	bool flushWrites();
+	size_t  readRaw (void *dest, size_t n);
+	ssize_t writeRaw(const void *source, size_t n);
 
 private:
 	// Disable copying.
@@ -0,0 +1,42 @@
+//==================================================================//
+/*
+	Untrunc - log.cpp
+
+	Untrunc is GPL software; you can freely distribute,
+	redistribute, modify & use under the terms of the GNU General
+	Public License; either version 2 or its successor.
+
+	Untrunc is distributed under the GPL "AS IS", without
+	any warranty; without the implied warranty of merchantability
+	or fitness for either an expressed or implied particular purpose.
+
+	Please see the included GNU General Public License (GPL) for
+	your rights and further details; see the file COPYING. If you
+	cannot, write to the Free Software Foundation, 59 Temple Place
+	Suite 330, Boston, MA 02111-1307, USA.  Or www.fsf.org
+
+	Copyright the Untrunc contributors
+                                                                    */
+//==================================================================//
+
+extern "C" {
+#include "libavutil/log.h"
+}  // extern "C"
+
+#include "log.h"
+
+
+LogLevel Log::current = LogInfo;
+
+void Log::setLevel(LogLevel level) {
+	current = level;
+	switch(level) {
+	case LogError:
+	case LogWarning:
+	case LogInfo:    av_log_set_level(AV_LOG_FATAL);   break;
+	case LogVerbose: av_log_set_level(AV_LOG_WARNING); break;
+	case LogDebug:   av_log_set_level(AV_LOG_INFO);    break;
+	}
+}
+
+// vim:set ts=4 sw=4 sts=4 noet:
@@ -0,0 +1,62 @@
+//==================================================================//
+/*
+    Untrunc - log.h
+
+    Untrunc is GPL software; you can freely distribute,
+    redistribute, modify & use under the terms of the GNU General
+    Public License; either version 2 or its successor.
+
+    Untrunc is distributed under the GPL "AS IS", without
+    any warranty; without the implied warranty of merchantability
+    or fitness for either an expressed or implied particular purpose.
+
+    Please see the included GNU General Public License (GPL) for
+    your rights and further details; see the file COPYING. If you
+    cannot, write to the Free Software Foundation, 59 Temple Place
+    Suite 330, Boston, MA 02111-1307, USA.  Or www.fsf.org
+
+    Copyright the Untrunc contributors
+                                                                    */
+//==================================================================//
+
+
+#ifndef LOG_H
+#define LOG_H
+
+#include <iostream>
+
+
+enum LogLevel {
+    LogError = 0,
+    LogWarning,     // -q shows only errors and warnings.
+    LogInfo,        // Default.
+    LogVerbose,     // -v
+    LogDebug        // -vv: every offset scanned and every NAL parsed.
+};
+
+// Messages above this level are compiled out (e.g. -DLOG_MAX_LEVEL=LogInfo).
+#ifndef LOG_MAX_LEVEL
+# define LOG_MAX_LEVEL  LogDebug
+#endif
+
+
+class Log {
+public:
+    static LogLevel level() { return current; }
+    // Also sets how much Libav logs: its complaints while probing garbage are noise below -vv.
+    static void setLevel(LogLevel level);
+
+    static bool enabled(LogLevel level) { return level <= LOG_MAX_LEVEL && level <= current; }
+    static std::ostream &stream(LogLevel level) { return level <= LogWarning ? std::cerr : std::clog; }
+
+private:
+    static LogLevel current;
+};
+
+// LOG(LogDebug) << "Offset: " << offset << '\n';
+// When the level is disabled nothing after LOG() is evaluated, so no formatting is done.
+// (A loop rather than if/else, so that it nests safely in an unbraced if.)
+#define LOG(level)  for(bool log_once_ = Log::enabled(level); log_once_; log_once_ = false) \
+                        Log::stream(level)
+
+#endif // LOG_H
@@ -20,25 +20,52 @@
 
 #include "mp4.h"
 #include "atom.h"
+#include "log.h"
 
 #include <iostream>
 #include <string>
+#include <cstdlib>
 using namespace std;
 
 void usage() {
-	cerr << "Usage: untrunc [-a -i] <ok.mp4> [<corrupt.mp4>]\n\n";
+	cerr << "Usage: untrunc [-a -i] [-q | -v | -vv] [-j <threads>] [--in-place] [--raw-io | --direct-io] <ok.mp4> [<corrupt.mp4>]\n\n"
+	     << "  -q            only report errors and warnings\n"
+	     << "  -v, -vv       more details; -vv reports every offset scanned\n"
+	     << "  -j <threads>  scan the corrupt mdat on up to <threads> threads\n"
+	     << "  --in-place    repair <corrupt.mp4> itself instead of writing <corrupt.mp4>_fixed.mp4\n"
+	     << "  --raw-io      read and write with large pread/pwrite calls instead of stdio\n"
+	     << "  --direct-io   like --raw-io, and bypass the page cache when writing the output\n\n";
 }
 
 int main(int argc, char *argv[]) {
 
     bool info = false;
     bool analyze = false;
+    bool in_place = false;
+    bool raw_io = false;
+    bool direct_io = false;
+    int threads = 1;
+    LogLevel log_level = LogInfo;
     int i = 1;
     for(; i < argc; i++) {
         string arg(argv[i]);
         if(arg[0] == '-') {
+            if(arg == "--in-place") in_place = true;
+            if(arg == "--raw-io") raw_io = true;
+            if(arg == "--direct-io") raw_io = direct_io = true;
             if(arg[1] == 'i') info = true;
             if(arg[1] == 'a') analyze = true;
+            if(arg == "-q")  log_level = LogWarning;
+            if(arg == "-v")  log_level = LogVerbose;
+            if(arg == "-vv") log_level = LogDebug;
+            if(arg[1] == 'j') {
+                if(arg.size() > 2)
+                    threads = atoi(arg.c_str() + 2);
+                else if(i + 1 < argc)
+                    threads = atoi(argv[++i]);
+                if(threads < 1)
+                    threads = 1;
+            }
         } else
             break;
     }
@@ -47,13 +74,17 @@ int main(int argc, char *argv[]) {
         return -1;
     }
 
+    Log::setLevel(log_level);
+    if(raw_io && !File::setRawIo(true, direct_io))
+        LOG(LogWarning) << "Raw or direct I/O is not supported here: using stdio.\n";
+
     string ok = argv[i];
     string corrupt;
     i++;
     if(i < argc)
         corrupt = argv[i];
 
-    cout << "Reading: " << ok << endl;
+    LOG(LogInfo) << "Reading: " << ok << endl;
     Mp4 mp4;
 
     try {
@@ -66,8 +97,9 @@ int main(int argc, char *argv[]) {
             mp4.analyze();
         }
         if(corrupt.size()) {
-            mp4.repair(corrupt);
-            mp4.saveVideo(corrupt + "_fixed.mp4");
+            mp4.repair(corrupt, threads);
+            if(!in_place || !mp4.saveInPlace(corrupt))
+                mp4.saveVideo(corrupt + "_fixed.mp4");
         }
     } catch(string e) {
         cerr << e << endl;
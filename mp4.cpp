@@ -26,6 +26,17 @@
 #include <ios>          // Pre-C++11: may not be included by <iostream>.
 #include <iomanip>
 #include <limits>
+#include <algorithm>
+#include <queue>
+#include <functional>   // for: greater<>
+#include <cstring>      // for: memcpy()
+#include <cstdlib>      // for: abs()
+
+#if defined(__AVX2__)
+# include <immintrin.h>
+#elif defined(__SSE2__)
+# include <emmintrin.h>
+#endif
 
 #ifndef  __STDC_LIMIT_MACROS
 # define __STDC_LIMIT_MACROS    1
@@ -35,6 +46,7 @@
 #endif
 extern "C" {
 #include <stdint.h>
+#include <pthread.h>
 #ifdef _WIN32
 # include <io.h>        // for: _isatty()
 #else
@@ -48,6 +60,8 @@ extern "C" {
 #include "mp4.h"
 #include "atom.h"
 #include "file.h"
+#include "byteorder.h"
+#include "log.h"
 
 
 // Stdio file descriptors.
@@ -63,6 +77,8 @@ using namespace std;
 
 namespace {
 	const int MaxFrameLength = 16000000;
+	// Leaf atoms larger than this (the mdat) stay in the file when opening.
+	const int64_t LazyAtomSize = 1 << 20;
 
 
 	// Store start-up addresses of C++ stdio stream buffers as identifiers.
@@ -173,7 +189,7 @@ Mp4::~Mp4() {
 }
 
 void Mp4::open(string filename) {
-	clog << "Opening: " << filename << '\n';
+	LOG(LogInfo) << "Opening: " << filename << '\n';
 	close();
 
 	{  // Parse ok file.
@@ -183,21 +199,39 @@ void Mp4::open(string filename) {
 
 		root = new Atom;
 		do {
-			Atom *atom = new Atom;
-			atom->parse(file);
-#ifdef VERBOSE1
-			clog << "Found atom: " << atom->name << '\n';
-#endif
-			root->children.push_back(atom);
+			off_t begin = file.pos();
+			Atom header;
+			header.parseHeader(file);
+
+			Atom *atom = NULL;
+			if(!Atom::isParent(header.name) && header.length > uint64_t(LazyAtomSize)) {
+				// Only Codec::parse() and analyze() look inside: read on demand, from a mapping.
+				if(header.start + int64_t(header.length) > int64_t(file.length()))
+					throw string("Failed reading atom content: ") + header.name;
+				BufferedAtom *buffered = new BufferedAtom(filename);
+				buffered->start  = header.start;
+				buffered->length = header.length;
+				memcpy(buffered->name, header.name, sizeof(buffered->name));
+				buffered->file_begin = file.pos();
+				buffered->file_end   = header.start + header.length;
+				file.seek(buffered->file_end);
+				atom = buffered;
+			} else {
+				file.seek(begin);
+				atom = new Atom;
+				atom->parse(file);
+			}
+			LOG(LogVerbose) << "Found atom: " << atom->name << '\n';
+			root->addChild(atom);
 		} while(!file.atEnd());
 	}  // {
 	file_name = filename;
 
 	if(root->atomByName("ctts"))
-		clog << "Found 'Composition Time To Sample' atom (ctts). Out of order samples possible.\n";
+		LOG(LogInfo) << "Found 'Composition Time To Sample' atom (ctts). Out of order samples possible.\n";
 
 	if(root->atomByName("sdtp"))
-		clog << "Found 'Independent and Disposable Samples' atom (sdtp). I and P frames might need to recover that info.\n";
+		LOG(LogInfo) << "Found 'Independent and Disposable Samples' atom (sdtp). I and P frames might need to recover that info.\n";
 
 	Atom *mvhd = root->atomByName("mvhd");
 	if(!mvhd)
@@ -270,7 +304,7 @@ void Mp4::printAtoms() {
 }
 
 bool Mp4::makeStreamable(string filename, string output_filename) {
-	clog << "Make Streamable: " << filename << '\n';
+	LOG(LogInfo) << "Make Streamable: " << filename << '\n';
 	Atom atom_root;
 	{  // Parse input file.
 		File file;
@@ -280,10 +314,8 @@ bool Mp4::makeStreamable(string filename, string output_filename) {
 		while(!file.atEnd()) {
 			Atom *atom = new Atom;
 			atom->parse(file);
-#ifdef VERBOSE1
-			clog << "Found atom: " << atom->name << '\n';
-#endif
-			atom_root.children.push_back(atom);
+			LOG(LogVerbose) << "Found atom: " << atom->name << '\n';
+			atom_root.addChild(atom);
 		}
 	}  // {
 
@@ -299,7 +331,7 @@ bool Mp4::makeStreamable(string filename, string output_filename) {
 	}
 
 	if(mdat->start > moov->start) {
-		clog << "File is already streamable." << endl;
+		LOG(LogInfo) << "File is already streamable." << endl;
 		return true;
 	}
 
@@ -309,33 +341,34 @@ bool Mp4::makeStreamable(string filename, string output_filename) {
 		new_start += ftyp->length;
 
 	int64_t diff = new_start - old_start;
-	clog << "Old: " << old_start << " -> New: " << new_start << '\n';
-#if 0 // MIGHT HAVE TO FIX THIS ONE TOO?
-	Atom *co64 = trak->atomByName("co64");
-	if(co64) {
-		trak->prune("co64");
-		Atom *stbl = trak->atomByName("stbl");
-		if(stbl) {
-			Atom *new_stco = new Atom;
-			memcpy(new_stco->name, "stco", min(sizeof("stco"), sizeof(new_stco->name)-1));
-			stbl->children.push_back(new_stco);
-		}
-	}
-#endif
+	LOG(LogVerbose) << "Old: " << old_start << " -> New: " << new_start << '\n';
 	std::vector<Atom *> stcos = moov->atomsByName("stco");
 	for(unsigned int i = 0; i < stcos.size(); ++i) {
 		Atom *stco = stcos[i];
 		int32_t nchunks = stco->readInt(4); // 4 version, 4 number of entries, 4 entries.
 		for(int j = 0; j < nchunks; ++j) {
 			int64_t pos    = int64_t(8) + 4*j;
-			int64_t offset = stco->readInt(pos) + diff;
-			clog << "O: " << offset << '\n';
+			int64_t offset = uint32_t(stco->readInt(pos)) + diff;
+			LOG(LogDebug) << "O: " << offset << '\n';
+			if(offset > int64_t(UINT32_MAX))
+				throw string("Chunk offset does not fit in 'Chunk Offset' atom (stco) anymore");
 			stco->writeInt(offset, pos);
 		}
 	}
+	std::vector<Atom *> co64s = moov->atomsByName("co64");
+	for(unsigned int i = 0; i < co64s.size(); ++i) {
+		Atom *co64 = co64s[i];
+		int32_t nchunks = co64->readInt(4); // 4 version, 4 number of entries, 8 entries.
+		for(int j = 0; j < nchunks; ++j) {
+			int64_t pos    = int64_t(8) + 8*j;
+			int64_t offset = co64->readInt64(pos) + diff;
+			LOG(LogDebug) << "O: " << offset << '\n';
+			co64->writeInt64(offset, pos);
+		}
+	}
 
 	{  // Save to output file.
-		clog << "Saving to: " << output_filename << '\n';
+		LOG(LogInfo) << "Saving to: " << output_filename << '\n';
 		File file;
 		if(!file.create(output_filename))
 			throw "Could not create file for writing: " + output_filename;
@@ -344,34 +377,22 @@ bool Mp4::makeStreamable(string filename, string output_filename) {
 			ftyp->write(file);
 		moov->write(file);
 		mdat->write(file);
+		if(!file.flush() || !file.close())
+			throw "Could not write file: " + output_filename;
 	}  // {
-	clog << endl;
+	LOG(LogInfo) << endl;
 	return true;
 }
 
-bool Mp4::save(string output_filename) {
-	// We save all atoms except:
-	//  ctts: composition offset (we use sample to time).
-	//  cslg: because it is used only when ctts is present.
-	//  stps: partial sync, same as sync.
-	//
-	// Movie is made by ftyp, moov, mdat (we need to know mdat begin, for absolute offsets).
-	// Assume offsets in stco are absolute and so to find the relative just subtrack mdat->start + 8.
-
-	clog << "Saving to: " << output_filename << '\n';
-	if(!root) {
-		cerr << "No file opened.\n";
-		return false;
-	}
-
+void Mp4::updateDuration() {
 	if(timescale == 0) {
 		timescale = 600;  // Default movie time scale.
-		clog << "Using new movie time scale: " << timescale << ".\n";
+		LOG(LogInfo) << "Using new movie time scale: " << timescale << ".\n";
 	}
 	duration = 0;
 	for(unsigned int i = 0; i < tracks.size(); ++i) {
 		Track &track = tracks[i];
-		clog << "Track " << i << " (" << track.codec.name << "): duration: "
+		LOG(LogInfo) << "Track " << i << " (" << track.codec.name << "): duration: "
 			 << track.duration << " timescale: " << track.timescale << '\n';
 		if(track.timescale == 0 && track.duration != 0)
 			cerr << "Track " << i << " (" << track.codec.name << ") has no time scale.\n";
@@ -395,16 +416,34 @@ bool Mp4::save(string output_filename) {
 			continue;
 		}
 		if(tkhd->readInt(20) == track_duration) continue;
-		clog << "Adjusting track duration to movie timescale: New duration: "
+		LOG(LogInfo) << "Adjusting track duration to movie timescale: New duration: "
 			 << track_duration << " timescale: " << timescale << ".\n";
 		tkhd->writeInt(track_duration, 20); // In movie timescale, not track timescale.
 	}
 
-	clog << "Movie duration: " << duration << " timescale: " << timescale << '\n';
+	LOG(LogInfo) << "Movie duration: " << duration << " timescale: " << timescale << '\n';
 	Atom *mvhd = root->atomByName("mvhd");
 	if(!mvhd)
 		throw string("Missing 'Movie Header' atom (mvhd)");
 	mvhd->writeInt(duration, 16);
+}
+
+bool Mp4::save(string output_filename) {
+	// We save all atoms except:
+	//  ctts: composition offset (we use sample to time).
+	//  cslg: because it is used only when ctts is present.
+	//  stps: partial sync, same as sync.
+	//
+	// Movie is made by ftyp, moov, mdat (we need to know mdat begin, for absolute offsets).
+	// Assume offsets in stco are absolute and so to find the relative just subtrack mdat->start + 8.
+
+	LOG(LogInfo) << "Saving to: " << output_filename << '\n';
+	if(!root) {
+		cerr << "No file opened.\n";
+		return false;
+	}
+
+	updateDuration();
 
 	Atom *ftyp = root->atomByName("ftyp");
 	Atom *moov = root->atomByName("moov");
@@ -423,30 +462,183 @@ bool Mp4::save(string output_filename) {
 
 	root->updateLength();
 
+	File file;
+	if(!file.create(output_filename))
+		throw "Could not create file for writing: " + output_filename;
+
 	// Fix offsets.
-	int64_t offset = moov->length + 8;
+	// Offsets past 4GB switch stco to co64, which makes moov larger
+	//  and moves the mdat: repeat until moov keeps its length.
+	Atom    free_atom;
+	int64_t padding = 0;
+	int64_t shifted = 0;    // Already added to the track offsets.
+	for(;;) {
+		int64_t offset = moov->length + 8;
+		if(ftyp)
+			offset += ftyp->length; // Not all .mov have an ftyp.
+		BufferedAtom *buffered = dynamic_cast<BufferedAtom *>(mdat);
+		if(buffered)
+			offset += buffered->headerSize() - 8;
+
+		// Keep the block alignment of the mdat content with a free atom,
+		//  so its data can be shared with the corrupt file (reflink).
+		padding = (buffered) ? buffered->reflinkPadding(file, offset) : 0;
+		if(padding > 0)
+			offset += padding;
+
+		for(unsigned int t = 0; t < tracks.size(); ++t) {
+			Track &track = tracks[t];
+			for(unsigned int i = 0; i < track.offsets.size(); ++i)
+				track.offsets[i] += offset - shifted;
+
+			track.writeToAtoms();  // Need to save the offsets back to the atoms.
+		}
+		shifted = offset;
+
+		uint64_t moov_length = moov->length;
+		root->updateLength();
+		if(moov->length == moov_length)
+			break;
+	}
+	if(padding > 0) {
+		memcpy(free_atom.name, "free", min(sizeof("free"), sizeof(free_atom.name)-1));
+		free_atom.content.resize(padding - 8);
+		free_atom.updateLength();
+	}
+
+	// Save to output file.
 	if(ftyp)
-		offset += ftyp->length; // Not all .mov have an ftyp.
+		ftyp->write(file);
+	moov->write(file);
+	if(padding > 0)
+		free_atom.write(file);
+	mdat->write(file);
+	if(!file.flush() || !file.close())
+		throw "Could not write file: " + output_filename;
+
+	LOG(LogInfo) << endl;
+	return true;
+}
+
+bool Mp4::saveInPlace(string corrupt_filename) {
+	// Keep the mdat of the corrupt file where it is:
+	//  cut the file after the last recovered packet, append the new moov
+	//  and patch the mdat header (switching to a 64-bit size if needed).
+	// Offsets in stco are then relative to the mdat position in the corrupt file.
+
+	LOG(LogInfo) << "Saving in place: " << corrupt_filename << '\n';
+	if(!root) {
+		cerr << "No file opened.\n";
+		return false;
+	}
+
+	Atom         *moov = root->atomByName("moov");
+	BufferedAtom *mdat = dynamic_cast<BufferedAtom *>(root->atomByName("mdat"));
+	if(!moov || !mdat) {
+		if(!moov)
+			cerr << "Missing 'Container for all the Meta-data' atom (moov).\n";
+		if(!mdat)
+			cerr << "No repaired 'Media Data container' atom (mdat).\n";
+		return false;
+	}
+
+	File file;
+	if(!file.openReadWrite(corrupt_filename))
+		throw "Could not open file for writing: " + corrupt_filename;
+
+	// Find the mdat header and any (placeholder) moov in front of it.
+	int64_t mdat_header = -1;   // Position of the mdat header.
+	bool    mdat_large  = false;
+	int64_t prev_begin  = -1;   // Position of the atom in front of mdat.
+	int64_t prev_length = 0;
+	char    prev_name[5] = "";
+	vector<int64_t> stale_moovs;
+	file.seek(0);
+	while(file.pos() < mdat->file_begin) {
+		Atom    atom;
+		int64_t begin = file.pos();
+		try {
+			atom.parseHeader(file);
+		} catch(string) {
+			break;
+		}
+		bool    large = (atom.start != begin);  // parseHeader() skips the 64-bit size.
+		int64_t end   = atom.start + atom.length;
+		if(atom.name == string("mdat")) {
+			if(file.pos() == mdat->file_begin) {
+				mdat_header = begin;
+				mdat_large  = large;
+			}
+			break;
+		}
+		if(atom.name == string("moov"))
+			stale_moovs.push_back(begin);
+		prev_begin  = begin;
+		prev_length = end - begin;
+		memcpy(prev_name, atom.name, sizeof(prev_name));
+		if(end < file.pos())
+			break;
+		file.seek(end);
+	}
+	if(mdat_header < 0) {
+		cerr << "Could not find the 'Media Data container' atom (mdat) header.\n";
+		return false;
+	}
+
+	// A 32-bit size can grow into a preceding 8 byte 'wide' or 'free' atom.
+	int64_t content_size = mdat->file_end - mdat->file_begin;
+	bool    fits32       = (content_size + 8 <= int64_t(UINT32_MAX));
+	if(!mdat_large && !fits32) {
+		bool wide = (prev_begin + prev_length == mdat_header && prev_length == 8
+					 && (prev_name == string("wide") || prev_name == string("free") || prev_name == string("skip")));
+		if(!wide) {
+			cerr << "The 'Media Data container' atom (mdat) needs a 64-bit size, "
+				 << "but there is no room for it in the header.\n";
+			return false;
+		}
+		mdat_header = prev_begin;
+		mdat_large  = true;
+	}
+
+	updateDuration();
+
+	moov->prune("ctts");
+	moov->prune("cslg");
+	moov->prune("stps");
+
+	root->updateLength();
 
 	for(unsigned int t = 0; t < tracks.size(); ++t) {
 		Track &track = tracks[t];
 		for(unsigned int i = 0; i < track.offsets.size(); ++i)
-			track.offsets[i] += offset;
+			track.offsets[i] += mdat->file_begin;
 
 		track.writeToAtoms();  // Need to save the offsets back to the atoms.
 	}
 
-	{  // Save to output file.
-		File file;
-		if(!file.create(output_filename))
-			throw "Could not create file for writing: " + output_filename;
+	// Append moov after the last recovered packet.
+	if(!file.truncate(mdat->file_end))
+		throw "Could not truncate file: " + corrupt_filename;
+	file.seek(mdat->file_end);
+	moov->write(file);
 
-		if(ftyp)
-			ftyp->write(file);
-		moov->write(file);
-		mdat->write(file);
-	}  // {
-	clog << endl;
+	// Patch the headers last: until here the file is just as broken as before.
+	for(unsigned int i = 0; i < stale_moovs.size(); ++i) {
+		file.seek(stale_moovs[i] + 4);
+		file.writeChar("free", 4);
+	}
+	file.seek(mdat_header);
+	if(mdat_large) {
+		file.writeInt(1);
+		file.writeChar("mdat", 4);
+		file.writeInt64(content_size + 16);
+	} else {
+		file.writeInt(content_size + 8);
+		file.writeChar("mdat", 4);
+	}
+	if(!file.flush() || !file.close())
+		throw "Could not write file: " + corrupt_filename;
+	LOG(LogInfo) << endl;
 	return true;
 }
 
@@ -462,26 +654,21 @@ void Mp4::analyze(bool interactive) {
 		cerr << "Missing 'Media Data container' atom (mdat).\n";
 		return;
 	}
+	BufferedAtom *buffered = dynamic_cast<BufferedAtom *>(mdat);  // Not loaded by open().
 
 	if(interactive) {
 		// For interactive analyzis, std::cin & std::cout must be connected to a terminal/tty.
 		if(!isATerminal(cin)) {
-#ifdef VERBOSE1
-			clog << "Cannot analyze interactively as input doesn't come directly from a terminal.\n";
-#endif
+			LOG(LogVerbose) << "Cannot analyze interactively as input doesn't come directly from a terminal.\n";
 			interactive = false;
 		}
 		if(interactive && !isATerminal(cout)) {
-#ifdef VERBOSE1
-			clog << "Cannot analyze interactively as output doesn't go directly to a terminal.\n";
-#endif
+			LOG(LogVerbose) << "Cannot analyze interactively as output doesn't go directly to a terminal.\n";
 			interactive = false;
 		}
 		if(interactive)
 			cin.clear();  // Reset state - clear transient errors of previous input operations.
-#ifdef VERBOSE1
 		clog.flush();
-#endif
 	}
 
 	for(unsigned int i = 0; i < tracks.size(); ++i) {
@@ -489,31 +676,36 @@ void Mp4::analyze(bool interactive) {
 		Track &track = tracks[i];
 		cout << "Track codec: " << track.codec.name << '\n';
 		cout << "Keyframes  : " << track.keyframes.size() << "\n\n";
-		for(unsigned int i = 0; i < track.keyframes.size(); ++i) {
-			int k = track.keyframes[i];
-			int64_t  offset = track.offsets[k] - (mdat->start + 8);
+		SampleCursor keys(track.trak);
+		for(unsigned int i = 0; i < track.keyframes.size() && keys.next(); ) {
+			if(keys.sample != track.keyframes[i])
+				continue;
+			++i;
+			int64_t  offset = keys.offset - (mdat->start + 8);
 			uint32_t begin  = mdat->readInt(offset);
 			uint32_t next   = mdat->readInt(offset + 4);
-			cout << setw(8) << k
-				 << " Size: " << setw(6) << track.sizes[k]
-				 << " offset " << setw(10) << track.offsets[k]
+			cout << setw(8) << keys.sample
+				 << " Size: " << setw(6) << keys.size
+				 << " offset " << setw(10) << keys.offset
 				 << "  begin: " << hex << setw(5) << begin << ' ' << setw(8) << next << dec << '\n';
 		}
 
-		for(unsigned int i = 0; i < track.offsets.size(); ++i) {
-			int64_t offset = track.offsets[i] - (mdat->start + 8);
-			unsigned char *start = &(mdat->content[offset]);
+		SampleCursor samples(track.trak);
+		while(samples.next()) {
+			int64_t offset = samples.offset - (mdat->start + 8);
 			int64_t maxlength64 = mdat->contentSize() - offset;
 			if(maxlength64 > MaxFrameLength)
 				maxlength64 = MaxFrameLength;
 			int maxlength = static_cast<int>(maxlength64);
+			const unsigned char *start = (buffered) ? buffered->getFragment(offset, maxlength64)
+													: &(mdat->content[offset]);
 
 			int64_t begin = mdat->readInt(offset);
 			int64_t next  = mdat->readInt(offset + 4);
-			int64_t end   = mdat->readInt(offset + track.sizes[i] - 4);
-			cout << "\n\n>" << setw(7) << i
-				 << " Size: " << setw(6) << track.sizes[i]
-				 << " offset " << setw(10) << track.offsets[i]
+			int64_t end   = mdat->readInt(offset + samples.size - 4);
+			cout << "\n\n>" << setw(7) << samples.sample
+				 << " Size: " << setw(6) << samples.size
+				 << " offset " << setw(10) << samples.offset
 				 << "  begin: " << hex << setw(5) << begin << ' ' << setw(8) << next
 				 << " end: " << setw(8) << end << dec << '\n';
 
@@ -522,14 +714,14 @@ void Mp4::analyze(bool interactive) {
 			int  duration = 0;
 			int  length   = track.codec.getLength(start, maxlength, duration);
 			// TODO: Check if duration is working with the stts duration.
-			cout << "Length: " << length << " true-length: " << track.sizes[i] << '\n';
+			cout << "Length: " << length << " true-length: " << samples.size << '\n';
 
 			bool wait = false;
 			if(!matches) {
 				cerr << "- Match failed!\n";
 				wait = interactive;
 			}
-			if(length != track.sizes[i]) {
+			if(length != samples.size) {
 				cerr << "- Length mismatch!\n";
 				wait = interactive;
 			}
@@ -543,7 +735,7 @@ void Mp4::analyze(bool interactive) {
 				cin.ignore(numeric_limits<streamsize>::max(), '\n');
 			}
 			//assert(matches);
-			//assert(length == track.sizes[i]);
+			//assert(length == samples.size);
 		}
 	}
 	cout << endl;
@@ -572,8 +764,796 @@ bool Mp4::parseTracks() {
 	return true;
 }
 
-bool Mp4::repair(string corrupt_filename) {
-	clog << "Repair: " << corrupt_filename << '\n';
+// Packet scanning
+namespace {
+	// Fragments of the mdat go straight to the decoders, which read a little past them.
+	typedef char FragmentPaddingCheck[(BufferedAtom::FragmentPadding >= AV_INPUT_BUFFER_PADDING_SIZE) ? 1 : -1];
+
+	// Least amount of mdat worth a worker thread of its own.
+	const int64_t MinSegmentSize = 8 << 20;
+	// Consecutive packets needed to trust a resynchronisation point.
+	const int ResyncChain = 4;
+	// Packets the track's model scores below this look nothing like the reference
+	//  (lead byte, type and size all unseen): they are not taken, whatever the decoder says.
+	const double RejectScore = -4;
+	// Consecutive packets of the predicted track needed to take chunks on trust.
+	const int LockPackets = 16;
+	// When nothing matches: packets to look back over, bytes a length may be off by,
+	//  ways around to try, and how far to look ahead for a resynchronisation point.
+	const int     BacktrackDepth = 4;
+	const int     LengthSlack    = 8;
+	const int     BeamWidth      = 32;
+	const int64_t ResyncWindow   = 256 << 10;
+	// Length probes (decodes, mostly) one recovery may cost, and all of them together:
+	//  past that the scan stops at the damage, as it would without recovering.
+	const int64_t RecoverProbes      = 1 << 14;
+	const int64_t TotalRecoverProbes = 1 << 20;
+
+	// Number of zero bytes at the start of data[0, size).
+	// Pre-allocated files can hold hundreds of MB of zeros: go at memory bandwidth.
+	size_t zeroPrefix(const unsigned char *data, size_t size) {
+		size_t i = 0;
+#if defined(__AVX2__)
+		for(; i + 64 <= size; i += 64) {
+			__m256i a = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(data + i));
+			__m256i b = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(data + i + 32));
+			__m256i v = _mm256_or_si256(a, b);
+			if(!_mm256_testz_si256(v, v))
+				break;
+		}
+#elif defined(__SSE2__)
+		const __m128i zero = _mm_setzero_si128();
+		for(; i + 64 <= size; i += 64) {
+			__m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i *>(data + i));
+			__m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i *>(data + i + 16));
+			__m128i c = _mm_loadu_si128(reinterpret_cast<const __m128i *>(data + i + 32));
+			__m128i d = _mm_loadu_si128(reinterpret_cast<const __m128i *>(data + i + 48));
+			__m128i v = _mm_or_si128(_mm_or_si128(a, b), _mm_or_si128(c, d));
+			if(_mm_movemask_epi8(_mm_cmpeq_epi8(v, zero)) != 0xffff)
+				break;
+		}
+#endif
+		// The rest, and the block with the first non-zero byte in it.
+		for(; i + 8 <= size; i += 8) {
+			uint64_t word;
+			memcpy(&word, data + i, sizeof(word));
+			if(word != 0)
+				break;
+		}
+		while(i < size && data[i] == 0)
+			++i;
+		return i;
+	}
+
+	// A packet found in the mdat content.
+	struct Packet {
+		int64_t offset;     // Relative to the start of the mdat content.
+		int     track;
+		int     length;
+		int     duration;   // Samples reported by the decoder (mp4a), or 0.
+		bool    keyframe;
+		double  score;      // What the track's packet model makes of it.
+	};
+
+	// Which track the next packet most likely belongs to, from the order of the
+	//  samples in the reference file: cameras interleave the chunks of their
+	//  tracks in a steady rhythm (say 1 audio chunk every N video frames).
+	class InterleavePredictor {
+	public:
+		InterleavePredictor() : ntracks(0) { }
+
+		// Learn from the samples of the reference tracks, before repair() clears them.
+		void learn(const vector<Track> &tracks);
+		// Tracks in the order to try them after run packets in a row of track last (-1: none yet).
+		const vector<unsigned int> &order(int last, int run) const;
+		// The track that always came next in the reference, or -1.
+		int sure(int last, int run) const;
+
+	private:
+		static const int MaxRun  = 64;      // Longer runs count as this long.
+		static const int MinSure = 8;       // Times a run must be seen to be sure what follows.
+
+		unsigned int ntracks;
+		vector<unsigned int> plain;         // Track order when nothing is known.
+		vector<vector<unsigned int> > orders;   // For each last track and run.
+		vector<int> sures;                  // For each last track and run.
+
+		static int state(int last, int run) { return last * (MaxRun + 1) + max(1, min(run, MaxRun)); }
+
+		static vector<unsigned int> byCount(const vector<int> &counts, const vector<unsigned int> &ties);
+	};
+
+	// Defined for std::min() and std::max(), which take them by reference.
+	const int InterleavePredictor::MaxRun;
+	const int InterleavePredictor::MinSure;
+
+	vector<unsigned int> InterleavePredictor::byCount(const vector<int> &counts, const vector<unsigned int> &ties) {
+		// Most seen first; the order of ties for the ones seen equally often.
+		vector<pair<int, unsigned int> > ranked;
+		for(unsigned int i = 0; i < ties.size(); ++i)
+			ranked.push_back(make_pair(-counts[ties[i]], i));
+		stable_sort(ranked.begin(), ranked.end());
+		vector<unsigned int> order;
+		for(unsigned int i = 0; i < ranked.size(); ++i)
+			order.push_back(ties[ranked[i].second]);
+		return order;
+	}
+
+	void InterleavePredictor::learn(const vector<Track> &tracks) {
+		ntracks = tracks.size();
+		plain.clear();
+		for(unsigned int i = 0; i < ntracks; ++i)
+			plain.push_back(i);
+
+		// The tracks of the samples, in file order: merge the sample tables of
+		//  the tracks (each in file order already) by offset.
+		vector<SampleCursor> cursors;
+		typedef pair<int64_t, unsigned int> Head;
+		priority_queue<Head, vector<Head>, greater<Head> > heads;
+		for(unsigned int i = 0; i < ntracks; ++i) {
+			cursors.push_back(SampleCursor(tracks[i].trak));
+			if(cursors[i].next())
+				heads.push(make_pair(cursors[i].offset, i));
+		}
+
+		// What came after each run of samples of a track, by run length,
+		//  and by track alone for runs never seen.
+		vector<vector<int> > counts(ntracks * (MaxRun + 1), vector<int>(ntracks, 0));
+		vector<vector<int> > totals(ntracks, vector<int>(ntracks, 0));
+		vector<bool> seen(ntracks * (MaxRun + 1), false);
+		int previous = -1;
+		int run      = 0;
+		while(!heads.empty()) {
+			unsigned int next = heads.top().second;
+			heads.pop();
+			if(cursors[next].next())
+				heads.push(make_pair(cursors[next].offset, next));
+			if(previous >= 0) {
+				counts[state(previous, run)][next]++;
+				totals[previous][next]++;
+				seen[state(previous, run)] = true;
+			}
+			run      = (int(next) == previous) ? min(run + 1, MaxRun) : 1;
+			previous = next;
+		}
+
+		orders.assign(ntracks * (MaxRun + 1), plain);
+		sures .assign(ntracks * (MaxRun + 1), -1);
+		for(unsigned int last = 0; last < ntracks; ++last) {
+			vector<unsigned int> fallback = byCount(totals[last], plain);
+			for(int r = 1; r <= MaxRun; ++r) {
+				int s = state(last, r);
+				if(!seen[s]) {
+					orders[s] = fallback;
+					continue;
+				}
+				orders[s] = byCount(counts[s], fallback);
+				int first = orders[s][0];
+				int total = 0;
+				for(unsigned int i = 0; i < ntracks; ++i)
+					total += counts[s][i];
+				if(total >= MinSure && counts[s][first] == total)
+					sures[s] = first;
+			}
+		}
+	}
+
+	const vector<unsigned int> &InterleavePredictor::order(int last, int run) const {
+		if(last < 0 || unsigned(last) >= ntracks)
+			return plain;
+		return orders[state(last, run)];
+	}
+
+	int InterleavePredictor::sure(int last, int run) const {
+		if(last < 0 || unsigned(last) >= ntracks)
+			return -1;
+		return sures[state(last, run)];
+	}
+
+
+	// Finds packets of the tracks in the mdat content, one offset at a time.
+	class PacketScanner {
+	public:
+		enum Step { Found, Skipped, Zeros, Failed };  // Zeros: skipped zero words only.
+
+		PacketScanner(vector<Track> &tracks, BufferedAtom *mdat, const InterleavePredictor &predictor);
+		~PacketScanner();
+
+		// Use private decoder contexts and probe state, and the file mapping if
+		//  there is one: trial decodes then leave the tracks alone, and with the
+		//  mapping this scanner can run on its own thread.  Fails if a decoder
+		//  can't be opened.
+		bool detach();
+		bool threadSafe() const { return content != NULL; }
+		// Flush the private decoders (reopen the ones decoding garbage reconfigured)
+		//  and take the probe state (AAC block walker...) from probes.
+		//  Forgets the last packet too.
+		bool reset(const vector<Codec> &probes);
+		bool reset() { return reset(codecs); }
+
+		// Look at offset and move it past a packet or past data to skip.
+		Step step(int64_t &offset, Packet &packet);
+		// Scan from offset until stop or until nothing matches; returns where it stopped.
+		int64_t scan(int64_t offset, int64_t stop, vector<Packet> &packets, bool &failed);
+		// Nothing matched at offset: find a way around and move offset there, redoing
+		//  packets after floor as needed.  False if there is none.
+		bool recover(vector<Packet> &packets, size_t floor, int64_t &offset);
+		// First offset in [begin, end) followed by ResyncChain packets, or -1.
+		// Needs a detached scanner, whose decoders are reset for the scan from there.
+		//  recover() uses it too: the serial scanner is detached as well.
+		int64_t resync(int64_t begin, int64_t end);
+
+		int64_t chunked() const { return inside; }  // Packets found by the chunk fast path.
+
+	private:
+		vector<Track> &tracks;
+		BufferedAtom  *mdat;
+		const unsigned char *content;       // Mapped mdat content, when detached.
+		int64_t        padded;              // Bytes of it followed by BufferedAtom::FragmentPadding more.
+		vector<unsigned char> tail;         // Zero padded copy of the content from tail_begin on.
+		int64_t        tail_begin;
+		vector<Codec>  codecs;              // Private copies, when detached.
+		vector<AVCodecContext*> contexts;  // Of codecs, by track; NULL for tracks without a decoder.
+
+		const InterleavePredictor &predictor;
+		int64_t probe_count;                // Lengths asked of the codecs so far.
+		int64_t probe_limit;                // match() fails from here on (while recovering).
+		int64_t recover_probes;             // Spent by recover(), in total.
+		int  last;                          // Track of the last packet found, or -1.
+		int  run;                           // Packets of it in a row.
+		int  confirmed;                     // Packets in a row of the track predicted first.
+		int64_t inside;
+		vector<unsigned int> deferred;      // Tracks step() tries last.
+
+		Codec &codec(unsigned int i) { return codecs.empty() ? tracks[i].codec : codecs[i]; }
+		// The content at offset, size bytes and the padding the decoders need.
+		const unsigned char *view(int64_t offset, int64_t size);
+		// Try a packet of track i at start; on success fill packet and move offset past it.
+		bool match(unsigned int i, const unsigned char *start, int maxlength, int64_t &offset, Packet &packet);
+		// A packet found where predicted was tried first: the next track depends on it.
+		void follow(const Packet &packet, int predicted);
+		void forget() { last = -1; run = 0; confirmed = 0; }
+		// ResyncChain packets follow offset, the last one ending past beyond.
+		bool chains(int64_t offset, int64_t beyond);
+		// recover() within the probe budget it sets.
+		bool recoverWithin(vector<Packet> &packets, size_t floor, int64_t &offset);
+		// Some track could start a packet here (zero words and atoms to skip excepted).
+		bool plausible(const unsigned char *start, int maxlength);
+		bool exhausted() const { return probe_count >= probe_limit; }
+
+		PacketScanner(const PacketScanner&);
+		PacketScanner& operator=(const PacketScanner&);
+	};
+
+	// Without a lock manager libav does not serialise avcodec_open2() of most decoders
+	//  (mp4v, alac, pcm...), it only counts the threads in it and fails the open:
+	//  the scanners of the worker threads open and free their decoders one at a time.
+	pthread_mutex_t codec_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+	void freeCopy(AVCodecContext *&context) {
+		pthread_mutex_lock(&codec_mutex);
+		avcodec_free_context(&context);
+		pthread_mutex_unlock(&codec_mutex);
+	}
+
+	PacketScanner::PacketScanner(vector<Track> &t, BufferedAtom *m, const InterleavePredictor &p)
+		: tracks(t), mdat(m), content(NULL), padded(0), tail_begin(0),
+		  predictor(p), probe_count(0), probe_limit(numeric_limits<int64_t>::max()), recover_probes(0),
+		  last(-1), run(0), confirmed(0), inside(0) { }
+
+	PacketScanner::~PacketScanner() {
+		for(unsigned int i = 0; i < contexts.size(); ++i)
+			freeCopy(contexts[i]);
+	}
+
+	// Open a decoder context of its own with the parameters of codec.
+	AVCodecContext *openCopy(const Codec &codec) {
+		pthread_mutex_lock(&codec_mutex);
+		AVCodecParameters *par = avcodec_parameters_alloc();
+		AVCodecContext *context = avcodec_alloc_context3(codec.codec);
+		bool ok = par && context
+			&& avcodec_parameters_from_context(par, codec.context) >= 0  // avcC/esds extradata included.
+			&& avcodec_parameters_to_context(context, par) >= 0
+			&& avcodec_open2(context, codec.codec, NULL) >= 0;
+		avcodec_parameters_free(&par);
+		if(!ok)
+			avcodec_free_context(&context);
+		pthread_mutex_unlock(&codec_mutex);
+		return context;
+	}
+
+	// Decoding garbage can make a decoder take other stream parameters (from
+	//  a sequence header in the noise): flushing it is not enough then.
+	bool reconfigured(const AVCodecContext *context, const AVCodecContext *original) {
+		return (original->width       && context->width       != original->width)
+			|| (original->height      && context->height      != original->height)
+			|| (original->sample_rate && context->sample_rate != original->sample_rate)
+			|| (original->channels    && context->channels    != original->channels);
+	}
+
+	bool PacketScanner::detach() {
+		content = mdat->mappedContent();
+		padded  = mdat->mappedPaddedSize();
+		tail.clear();
+		for(unsigned int i = 0; i < contexts.size(); ++i)
+			freeCopy(contexts[i]);
+		contexts.clear();
+		codecs.clear();
+		for(unsigned int i = 0; i < tracks.size(); ++i)
+			codecs.push_back(tracks[i].codec);
+		return reset();
+	}
+
+	bool PacketScanner::reset(const vector<Codec> &probes) {
+		forget();
+		contexts.resize(codecs.size(), NULL);
+		for(unsigned int i = 0; i < codecs.size(); ++i) {
+			const Codec &original = tracks[i].codec;
+			AVCodecContext *&context = contexts[i];
+			if(original.context && original.codec) {
+				if(context && reconfigured(context, original.context)) {
+					LOG(LogDebug) << "Reopening the " << original.name << " decoder.\n";
+					freeCopy(context);
+				}
+				if(context) {
+					avcodec_flush_buffers(context);
+				} else {
+					context = openCopy(original);
+					if(!context)
+						return false;
+				}
+			}
+			codecs[i] = probes[i];
+			codecs[i].context = context;
+		}
+		return true;
+	}
+
+	const unsigned char *PacketScanner::view(int64_t offset, int64_t size) {
+		if(!content)
+			return mdat->getFragment(offset, size);
+		if(offset + size <= padded)
+			return content + offset;
+		// The mapping ends with the content: copy all a view can start in, once.
+		if(tail.empty()) {
+			int64_t end = mdat->contentSize();
+			tail_begin = max(int64_t(0), padded - MaxFrameLength);
+			tail.assign(content + tail_begin, content + end);
+			tail.resize(tail.size() + BufferedAtom::FragmentPadding, 0);
+		}
+		assert(offset >= tail_begin);
+		return &tail[offset - tail_begin];
+	}
+
+	PacketScanner::Step PacketScanner::step(int64_t &offset, Packet &packet) {
+		int64_t maxlength64 = mdat->contentSize() - offset;
+		if(maxlength64 > MaxFrameLength)
+			maxlength64 = MaxFrameLength;
+		if(maxlength64 < 8)
+			return Failed;
+		const unsigned char *start = view(offset, maxlength64);
+		int maxlength = static_cast<int>(maxlength64);
+
+		uint32_t begin = readBE<uint32_t>(start);
+		if(begin == 0) {
+			// Skip all the zero words in view at once, as if 4 bytes at a time:
+			//  up to the next word with a non-zero byte, keeping 8 bytes in view.
+			int64_t words = (maxlength64 - 8) / 4 + 1;
+			int64_t zeros = zeroPrefix(start, words * 4) / 4;
+			offset += 4 * max(zeros, int64_t(1));
+			return Zeros;
+		}
+
+		LOG(LogDebug) << "Offset: " << setw(10) << offset
+			<< "  begin: " << hex << setw(5) << begin << ' ' << setw(8) << readBE<uint32_t>(start + 4) << dec << '\n';
+
+		// Skip fake moov.
+		//  begin is the atom size: readBE() already did the swap32() of a native read.
+		if(start[4] == 'm' && start[5] == 'o' && start[6] == 'o' && start[7] == 'v') {
+			LOG(LogVerbose) << "Skipping 'Container for all the Meta-data' atom (moov): begin: 0x"
+				 << hex << begin << dec << ".\n";
+			offset += begin;
+			return Skipped;
+		}
+
+		//skip free block!
+		if(start[4] == 'f' && start[5] == 'r' && start[6] == 'e' && start[7] == 'e') {
+			LOG(LogVerbose) << "Skipping 'Free space' atom (free): begin: 0x"
+				 << hex << begin << dec << ".\n";
+			offset += begin;
+			return Skipped;
+		}
+
+		// Once the interleaving has been predicted right for a while, a packet inside
+		//  a chunk only goes through the length parser of the chunk's track.
+		//  Chunk boundaries, and packets it rejects, get the careful probing below.
+		if(confirmed >= LockPackets && last >= 0 && predictor.sure(last, run) == last) {
+			if(match(last, start, maxlength, offset, packet)) {
+				follow(packet, last);
+				++inside;
+				return Found;
+			}
+			LOG(LogVerbose) << "Chunk of track " << last << " ended early at " << offset << ".\n";
+			confirmed = 0;
+		}
+
+		// Try the likely next track first.  Tracks whose model rules out this start
+		//  are only decoded if no other track matches.
+		const vector<unsigned int> &order = predictor.order(last, run);
+		deferred.clear();
+		for(unsigned int k = 0; k < order.size(); ++k) {
+			unsigned int i = order[k];
+			if(codec(i).unlikely(start, maxlength)) {
+				LOG(LogDebug) << "Track " << i << " unlikely, deferred.\n";
+				deferred.push_back(i);
+				continue;
+			}
+			if(match(i, start, maxlength, offset, packet)) {
+				follow(packet, order[0]);
+				return Found;
+			}
+		}
+		for(unsigned int i = 0; i < deferred.size(); ++i) {
+			if(match(deferred[i], start, maxlength, offset, packet)) {
+				follow(packet, order[0]);
+				return Found;
+			}
+		}
+		LOG(LogDebug) << '\n';
+		return Failed;
+	}
+
+	bool PacketScanner::match(unsigned int i, const unsigned char *start, int maxlength, int64_t &offset, Packet &packet) {
+		Codec &track_codec = codec(i);
+		LOG(LogDebug) << "Track " << i << " codec: " << track_codec.name << '\n';
+		// Sometime audio packets are difficult to match, but if they are the only ones....
+		if(tracks.size() > 1 && !track_codec.matchSample(start, maxlength))
+			return false;
+		if(exhausted())
+			return false;
+		++probe_count;
+		int duration = 0;
+		int length   = track_codec.getLength(start, maxlength, duration);
+		if(length < -1 || length > MaxFrameLength) {
+			LOG(LogDebug) << "\nInvalid length: " << length << ". Wrong match in track: " << i << ".\n";
+			return false;
+		}
+		if(length == -1 || length == 0) {
+			return false;
+		}
+		if(length >= maxlength)
+			return false;
+		double score = track_codec.score(start, maxlength, length);
+		if(score < RejectScore) {
+			LOG(LogDebug) << "Length: " << length << " rejected by the packet model (" << score << ").\n";
+			return false;
+		}
+		if(length > 8)
+			LOG(LogDebug) << "Length: " << length << " found as: " << track_codec.name << '\n';
+		packet.offset   = offset;
+		packet.track    = i;
+		packet.length   = length;
+		packet.duration = duration;
+		packet.keyframe = track_codec.isKeyframe(start, maxlength);
+		packet.score    = score;
+		offset += length;
+		LOG(LogDebug) << '\n';
+		return true;
+	}
+
+	void PacketScanner::follow(const Packet &packet, int predicted) {
+		confirmed = (packet.track == predicted) ? confirmed + 1 : 0;
+		run  = (packet.track == last) ? run + 1 : 1;
+		last = packet.track;
+	}
+
+	int64_t PacketScanner::scan(int64_t offset, int64_t stop, vector<Packet> &packets, bool &failed) {
+		failed = false;
+		size_t floor = packets.size();
+		Packet packet;
+		while(offset < stop) {
+			Step result = step(offset, packet);
+			if(result == Failed && recover(packets, floor, offset))
+				continue;
+			if(result == Failed) {
+				failed = true;
+				break;
+			}
+			if(result == Found)
+				packets.push_back(packet);
+		}
+		return offset;
+	}
+
+	bool PacketScanner::chains(int64_t offset, int64_t beyond) {
+		// A trial: leave what the scan knows as it was.
+		int saved_last = last, saved_run = run, saved_confirmed = confirmed;
+		int64_t saved_inside = inside;
+		Packet packet;
+		int found = 0;
+		while(found < ResyncChain || offset <= beyond) {
+			Step result = step(offset, packet);
+			if(result == Failed)
+				break;
+			if(result == Found)
+				++found;
+		}
+		last = saved_last;
+		run  = saved_run;
+		confirmed = saved_confirmed;
+		inside    = saved_inside;
+		return found >= ResyncChain && offset > beyond;
+	}
+
+	// A different reading of one of the last packets, and what it costs.
+	struct Alternative {
+		double cost;
+		int    undone;      // Packets of the old reading dropped, this one's included.
+		Packet packet;
+
+		bool operator<(const Alternative &other) const { return cost < other.cost; }
+	};
+
+	bool PacketScanner::recover(vector<Packet> &packets, size_t floor, int64_t &offset) {
+		int64_t size = mdat->contentSize();
+		if(size - offset <= LengthSlack)
+			return false;   // The end of the data (a cut packet, maybe), not damage.
+		if(recover_probes >= TotalRecoverProbes) {
+			LOG(LogVerbose) << "Nothing matches at " << offset << ": no more recovery tried.\n";
+			return false;
+		}
+		int64_t spent = probe_count;
+		probe_limit = probe_count + min(RecoverProbes, TotalRecoverProbes - recover_probes);
+		bool recovered = recoverWithin(packets, floor, offset);
+		probe_limit = numeric_limits<int64_t>::max();
+		recover_probes += probe_count - spent;
+		return recovered;
+	}
+
+	bool PacketScanner::recoverWithin(vector<Packet> &packets, size_t floor, int64_t &offset) {
+		int64_t size = mdat->contentSize();
+		int64_t failed_at = offset;
+		const vector<Codec> probes(codecs);     // Trials must not change what the scan knows.
+
+		// Other tracks, and nearby lengths, for each of the last packets.  Undoing
+		//  a packet costs most, a track other than the one found less, and each
+		//  byte a length moves a little; lengths the track's model finds common are
+		//  cheaper.  Packets of the old reading that were right are found again.
+		vector<Alternative> alternatives;
+		for(int k = 1; k <= BacktrackDepth && packets.size() >= floor + k; ++k) {
+			const Packet &old = packets[packets.size() - k];
+			int64_t maxlength64 = min(size - old.offset, int64_t(MaxFrameLength));
+			const unsigned char *start = view(old.offset, maxlength64);
+			int maxlength = static_cast<int>(maxlength64);
+
+			Alternative alternative;
+			alternative.undone = k;
+			for(unsigned int i = 0; i < tracks.size(); ++i) {
+				int64_t next = old.offset;
+				if(!match(i, start, maxlength, next, alternative.packet))
+					continue;
+				if(alternative.packet.track == old.track && alternative.packet.length == old.length)
+					continue;
+				alternative.cost = k + (int(i) != old.track ? 0.5 : 0.2)
+					- 0.01 * codec(i).model.sizeScore(alternative.packet.length);
+				alternatives.push_back(alternative);
+			}
+			for(int d = -LengthSlack; d <= LengthSlack; ++d) {
+				alternative.packet = old;
+				alternative.packet.length += d;
+				if(d == 0 || alternative.packet.length <= 0 || alternative.packet.length >= maxlength)
+					continue;
+				alternative.cost = k + 0.1 * abs(d)
+					- 0.01 * codec(old.track).model.sizeScore(alternative.packet.length);
+				alternatives.push_back(alternative);
+			}
+		}
+		stable_sort(alternatives.begin(), alternatives.end());
+
+		// The cheapest the scan can go on from, past where it failed.
+		for(unsigned int i = 0; i < alternatives.size() && int(i) < BeamWidth && !exhausted(); ++i) {
+			const Alternative &alternative = alternatives[i];
+			const Packet &packet = alternative.packet;
+			if(!reset(probes) || !chains(packet.offset + packet.length, failed_at))
+				continue;
+			LOG(LogVerbose) << "Nothing matches at " << failed_at << ": reading the packet at " << packet.offset
+				<< " as track " << packet.track << " of length " << packet.length
+				<< " (" << alternative.undone << " packets undone).\n";
+			packets.resize(packets.size() - alternative.undone);
+			packets.push_back(packet);
+			offset = packet.offset + packet.length;
+			if(!reset(probes))  // Go on with decoders the trial did not disturb.
+				return false;
+			follow(packet, packet.track);
+			return true;
+		}
+
+		// Else skip the damage, if the packets start again close by.
+		if(exhausted() || !reset(probes))
+			return false;
+		int64_t found = resync(failed_at + 1, min(failed_at + ResyncWindow, size));
+		if(found < 0)
+			return false;
+		LOG(LogVerbose) << "Nothing matches at " << failed_at << ": skipping " << found - failed_at
+			<< " bytes to " << found << ".\n";
+		offset = found;
+		return true;
+	}
+
+	bool PacketScanner::plausible(const unsigned char *start, int maxlength) {
+		if(readBE<uint32_t>(start) == 0)
+			return true;    // step() skips zero words fast.
+		for(unsigned int i = 0; i < tracks.size(); ++i) {
+			Codec &track_codec = codec(i);
+			if(tracks.size() > 1 && !track_codec.matchSample(start, maxlength))
+				continue;
+			if(!track_codec.unlikely(start, maxlength) && track_codec.score(start, maxlength, 0) >= RejectScore)
+				return true;
+		}
+		return false;
+	}
+
+	int64_t PacketScanner::resync(int64_t begin, int64_t end) {
+		const vector<Codec> probes(codecs);
+		Packet packet;
+		for(int64_t candidate = begin; candidate < end && !exhausted(); ++candidate) {
+			int64_t maxlength = min(mdat->contentSize() - candidate, int64_t(MaxFrameLength));
+			if(maxlength >= 8 && !plausible(view(candidate, maxlength), int(maxlength)))
+				continue;   // No track's model would take a packet here: don't decode.
+			int64_t offset = candidate;
+			forget();
+			Step first = step(offset, packet);
+			if(first == Zeros)
+				candidate = offset - 4;  // The words starting in between are zeros too.
+			if(first != Found)
+				continue;   // A resynchronisation point must start a packet.
+
+			// Check the chain with decoders not disturbed by the bytes tried so far.
+			if(!reset(probes))
+				return -1;
+			offset = candidate;
+			int found = 0;
+			while(found < ResyncChain) {
+				Step result = step(offset, packet);
+				if(result == Failed)
+					break;
+				if(result == Found)
+					++found;
+			}
+			if(found == ResyncChain && reset(probes))
+				return candidate;
+		}
+		return -1;
+	}
+
+
+	// A part of the mdat content scanned by a worker thread.
+	struct Segment {
+		PacketScanner *scanner;
+		int64_t begin;      // Range where the first packet is searched for.
+		int64_t end;
+		int64_t resync;     // First packet found in the segment, or -1.
+		int64_t stop;       // Where the scan stopped.
+		bool    failed;     // The scan stopped on data no track matches.
+		vector<Packet> packets;
+
+		// Index of the packet starting at offset, packets.size() for the
+		//  end of the scan, or -1 if the serial scan can't join here.
+		int join(int64_t offset) const {
+			if(resync < 0 || offset < resync || offset > stop)
+				return -1;
+			if(offset == stop)
+				return packets.size();
+			Packet key;
+			key.offset = offset;
+			vector<Packet>::const_iterator it = lower_bound(packets.begin(), packets.end(), key, byOffset);
+			if(it == packets.end() || it->offset != offset)
+				return -1;
+			return it - packets.begin();
+		}
+
+		static bool byOffset(const Packet &a, const Packet &b) { return a.offset < b.offset; }
+	};
+
+	void *scanSegment(void *arg) {
+		Segment &segment = *static_cast<Segment *>(arg);
+		try {
+			segment.resync = segment.begin == 0 ? 0 : segment.scanner->resync(segment.begin, segment.end);
+			if(segment.resync >= 0)
+				// Stop at the next segment: the stitching joins it there.
+				segment.stop = segment.scanner->scan(segment.resync, segment.end, segment.packets, segment.failed);
+		} catch(...) {
+			// Leave this segment to the serial scan, which reports the error.
+			segment.resync = -1;
+			segment.packets.clear();
+		}
+		return NULL;
+	}
+
+	// Scan the mdat content for packets, splitting it between up to `threads`
+	//  worker threads.  Returns the offset where the scan stopped.
+	int64_t scanPackets(vector<Track> &tracks, BufferedAtom *mdat, const InterleavePredictor &predictor,
+						int threads, vector<Packet> &packets) {
+		int64_t size = mdat->contentSize();
+		int nsegments = threads;
+		if(nsegments > size / MinSegmentSize)
+			nsegments = size / MinSegmentSize;
+
+		// Private decoders for the serial scan too: recover() tries garbage on them.
+		PacketScanner serial(tracks, mdat, predictor);
+		if(!serial.detach())
+			throw string("Could not open the decoders for the scan");
+		bool failed = false;
+		if(nsegments < 2 || !mdat->mappedContent()) {
+			int64_t offset = serial.scan(0, size, packets, failed);
+			LOG(LogVerbose) << serial.chunked() << " packets found inside predicted chunks.\n";
+			return offset;
+		}
+
+		// Each worker resynchronises at the first reliable packet of its segment
+		//  and scans up to the start of the next one.
+		vector<Segment> segments(nsegments);
+		vector<PacketScanner *> scanners;
+		vector<pthread_t> workers;
+		for(int i = 0; i < nsegments; ++i) {
+			Segment &segment = segments[i];
+			segment.begin  = size / nsegments * i;
+			segment.end    = i + 1 < nsegments ? size / nsegments * (i + 1) : size;
+			segment.resync = -1;
+			segment.stop   = segment.begin;
+			segment.failed = false;
+
+			segment.scanner = new PacketScanner(tracks, mdat, predictor);
+			scanners.push_back(segment.scanner);
+			pthread_t worker;
+			if(!segment.scanner->detach() || !segment.scanner->threadSafe() || pthread_create(&worker, NULL, scanSegment, &segment) != 0)
+				continue;   // Left to the serial scan.
+			workers.push_back(worker);
+		}
+		for(unsigned int i = 0; i < workers.size(); ++i)
+			pthread_join(workers[i], NULL);
+		int64_t chunked = 0;
+		for(unsigned int i = 0; i < scanners.size(); ++i) {
+			chunked += scanners[i]->chunked();
+			delete scanners[i];
+		}
+
+		// Stitch: continue serially from where the previous segment stopped until
+		//  landing on a packet the next worker found too; from there on the serial
+		//  scan would find the same packets.
+		int64_t offset = 0;
+		for(int i = 0; i < nsegments && !failed; ++i) {
+			Segment &segment = segments[i];
+			if(i > 0 && segment.resync >= 0 && offset < segment.end && segment.join(offset) < 0)
+				LOG(LogVerbose) << "Segment " << i << " does not join at " << offset << ", scanning serially.\n";
+			Packet packet;
+			while(offset < segment.end) {
+				int joined = segment.join(offset);
+				if(joined >= 0) {
+					packets.insert(packets.end(), segment.packets.begin() + joined, segment.packets.end());
+					offset = segment.stop;
+					failed = segment.failed;
+					break;
+				}
+				PacketScanner::Step result = serial.step(offset, packet);
+				if(result == PacketScanner::Failed && serial.recover(packets, 0, offset))
+					continue;
+				if(result == PacketScanner::Failed) {
+					failed = true;
+					break;
+				}
+				if(result == PacketScanner::Found)
+					packets.push_back(packet);
+			}
+		}
+		LOG(LogVerbose) << chunked + serial.chunked() << " packets found inside predicted chunks.\n";
+		return offset;
+	}
+}; // namespace
+
+
+bool Mp4::repair(string corrupt_filename, int threads) {
+	LOG(LogInfo) << "Repair: " << corrupt_filename << '\n';
 	BufferedAtom *mdat = NULL;
 	{  // Parse corrupt file.
 		File file;
@@ -603,122 +1583,51 @@ bool Mp4::repair(string corrupt_filename) {
 			memcpy(mdat->version, atom.version, sizeof(mdat->version));
 
 			mdat->file_begin = file.pos();
-			mdat->file_end   = file.length() - file.pos();
+			mdat->file_end   = file.length();
 			//mdat->content = file.read(file.length() - file.pos());
 			break;
 		}
 	}  // {
 
+	// mp4a is more reliable than avc1: try it first when the interleaving says nothing.
+	if(tracks.size() > 1 && tracks[0].codec.name != "mp4a" && tracks[1].codec.name == "mp4a") {
+		LOG(LogVerbose) << "Swapping tracks: track 0 (" << tracks[0].codec.name << ") <-> track 1 (mp4a).\n";
+		swap(tracks[0], tracks[1]);
+	}
+
+	InterleavePredictor predictor;
+	predictor.learn(tracks);
+
 	for(unsigned int i = 0; i < tracks.size(); ++i)
 		tracks[i].clear();
 
-	// mp4a is more reliable than avc1.
-	if(tracks.size() > 1 && tracks[0].codec.name != "mp4a" && tracks[1].codec.name == "mp4a") {
-#ifdef VERBOSE1
-		clog << "Swapping tracks: track 0 (" << tracks[0].codec.name << ") <-> track 1 (mp4a).\n";
-#endif
-		swap(tracks[0], tracks[1]);
+	vector<Packet> packets;
+	int64_t offset = scanPackets(tracks, mdat, predictor, threads, packets);
+	if(offset < mdat->contentSize()) {
+		// This could be a problem for large files.
+		//assert(mdat->contentSize() + 8 == mdat->length);
+		mdat->file_end = mdat->file_begin + offset;
+		mdat->length   = mdat->file_end - mdat->file_begin;
+		//mdat->content.resize(offset);
+		//mdat->length = mdat->contentSize() + 8;
 	}
 
 	// mp4a can be decoded and reports the number of samples (duration in samplerate scale).
 	// In some videos the duration (stts) can be variable and we can rebuild them using these values.
 	vector<int> audiotimes;
-	unsigned long count = 0;
-	off_t offset = 0;
-	while(offset < mdat->contentSize()) {
-		//unsigned char *start = &mdat->content[offset];
-		int64_t maxlength64 = mdat->contentSize() - offset;
-		if(maxlength64 > MaxFrameLength)
-			maxlength64 = MaxFrameLength;
-		unsigned char *start = mdat->getFragment(offset, maxlength64);
-		int maxlength = static_cast<int>(maxlength64);
-
-		unsigned int begin = mdat->readInt(offset);
-		if(begin == 0) {
-#if 0 // AARRGH this sometimes is not very correct, unless it's all zeros.
-			// Skip zeros to next 000.
-			offset &= 0xfffff000;
-			offset += 0x1000;
-#else
-			offset += 4;
-#endif
-			continue;
-		}
-
-#ifdef VERBOSE1
-		unsigned int next  = mdat->readInt(offset + 4);
-		clog << "Offset: " << setw(10) << offset
-			 << "  begin: " << hex << setw(5) << begin << ' ' << setw(8) << next << dec << '\n';
-#endif
-
-		// Skip fake moov.
-		if(start[4] == 'm' && start[5] == 'o' && start[6] == 'o' && start[7] == 'v') {
-			clog << "Skipping 'Container for all the Meta-data' atom (moov): begin: 0x"
-				 << hex << swap32(begin) << dec << ".\n";
-			offset += swap32(begin);
-			continue;
-		}
-
-		//skip free block!
-		if(start[4] == 'f' && start[5] == 'r' && start[6] == 'e' && start[7] == 'e') {
-			clog << "Skipping 'Container for all the Meta-data' atom (moov): begin: 0x"
-				 << hex << swap32(begin) << dec << ".\n";
-			offset += swap32(begin);
-			continue;
-		}
-
-		bool found = false;
-		for(unsigned int i = 0; i < tracks.size(); ++i) {
-			Track &track = tracks[i];
-			clog << "Track " << i << " codec: " << track.codec.name << '\n';
-			// Sometime audio packets are difficult to match, but if they are the only ones....
-			if(tracks.size() > 1 && !track.codec.matchSample(start, maxlength))
-				continue;
-			int duration = 0;
-			int length   = track.codec.getLength(start, maxlength, duration);
-			if(length < -1 || length > MaxFrameLength) {
-				clog << "\nInvalid length: " << length << ". Wrong match in track: " << i << ".\n";
-				continue;
-			}
-			if(length == -1 || length == 0) {
-				continue;
-			}
-			if(length >= maxlength)
-				continue;
-#ifdef VERBOSE1
-			if(length > 8)
-				clog << "Length: " << length << " found as: " << track.codec.name << '\n';
-#endif
-			bool keyframe = track.codec.isKeyframe(start, maxlength);
-			if(keyframe)
-				track.keyframes.push_back(track.offsets.size());
-			track.offsets.push_back(offset);
-			track.sizes.push_back(length);
-			offset += length;
-
-			if(duration)
-				audiotimes.push_back(duration);
-
-			found = true;
-			break;
-		}
-#ifdef VERBOSE1
-		clog << '\n';
-#endif
-
-		if(!found) {
-			// This could be a problem for large files.
-			//assert(mdat->contentSize() + 8 == mdat->length);
-			mdat->file_end = mdat->file_begin + offset;
-			mdat->length   = mdat->file_end - mdat->file_begin;
-			//mdat->content.resize(offset);
-			//mdat->length = mdat->contentSize() + 8;
-			break;
-		}
-		count++;
+	for(unsigned int i = 0; i < packets.size(); ++i) {
+		const Packet &packet = packets[i];
+		Track &track = tracks[packet.track];
+		if(packet.keyframe)
+			track.keyframes.push_back(track.offsets.size());
+		track.offsets.push_back(packet.offset);
+		track.sizes.push_back(packet.length);
+		if(packet.duration)
+			audiotimes.push_back(packet.duration);
 	}
+	unsigned long count = packets.size();
 
-	clog << "Found " << count << " packets.\n";
+	LOG(LogInfo) << "Found " << count << " packets.\n";
 
 	for(unsigned int i = 0; i < tracks.size(); ++i) {
 		if(audiotimes.size() == tracks[i].offsets.size())
@@ -734,15 +1643,12 @@ bool Mp4::repair(string corrupt_filename) {
 		return false;
 	}
 	mdat->start = original_mdat->start;
-#ifdef VERBOSE1
-	clog << "Replacing 'Media Data content' atom (mdat).\n";
-#endif
-	root->replace(original_mdat, mdat);
+	LOG(LogVerbose) << "Replacing 'Media Data content' atom (mdat).\n";
+	root->replace(original_mdat, mdat);  // Deletes original_mdat.
 	//original_mdat->content.swap(mdat->content);
 	//original_mdat->start = -8;
-	delete original_mdat;
 
-	clog << endl;
+	LOG(LogInfo) << endl;
 	return true;
 }
 
@@ -41,8 +41,9 @@ public:
     ~Mp4();
 
     void open     (std::string filename);
-    bool repair   (std::string corrupt_filename);
+    bool repair   (std::string corrupt_filename, int threads = 1);
     bool save     (std::string output_filename);
+    bool saveInPlace(std::string corrupt_filename);
     bool saveVideo(std::string output_filename) { return save(output_filename); }
 
     void printMediaInfo();
@@ -61,6 +62,7 @@ protected:
     void close();
     bool parseTracks();
     void writeTracksToAtoms();
+    void updateDuration();
 };
 
 #endif // MP4_H
@@ -0,0 +1,185 @@
+//==================================================================//
+/*
+	Untrunc - tests/probe_test.cpp
+
+	Untrunc is GPL software; you can freely distribute,
+	redistribute, modify & use under the terms of the GNU General
+	Public License; either version 2 or its successor.
+
+	Untrunc is distributed under the GPL "AS IS", without
+	any warranty; without the implied warranty of merchantability
+	or fitness for either an expressed or implied particular purpose.
+
+	Please see the included GNU General Public License (GPL) for
+	your rights and further details; see the file COPYING. If you
+	cannot, write to the Free Software Foundation, 59 Temple Place
+	Suite 330, Boston, MA 02111-1307, USA.  Or www.fsf.org
+
+	Copyright the Untrunc contributors
+                                                                    */
+//==================================================================//
+
+// Length probes must not depend on the probes before them: a packet probed
+//  again after a failed trial in between gives the same length.
+//
+// Build and run as described under "Running the tests" in README.md.
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include <cstring>
+
+#ifndef __STDC_CONSTANT_MACROS
+# define __STDC_CONSTANT_MACROS 1
+#endif
+extern "C" {
+#include <stdint.h>
+#include "libavcodec/avcodec.h"
+}
+
+#include "track.h"
+#include "atom.h"
+#include "log.h"
+
+using namespace std;
+
+
+namespace {
+	const int Width   = 64;
+	const int Height  = 64;
+	const int Packets = 3;
+
+	// A few MPEG-4 part 2 packets: an I frame (with the VOL header) and P frames.
+	vector<vector<uint8_t> > encode() {
+		vector<vector<uint8_t> > packets;
+		AVCodec *encoder = avcodec_find_encoder(AV_CODEC_ID_MPEG4);
+		AVCodecContext *context = encoder ? avcodec_alloc_context3(encoder) : NULL;
+		if(!context)
+			return packets;
+		context->width        = Width;
+		context->height       = Height;
+		context->pix_fmt      = AV_PIX_FMT_YUV420P;
+		context->time_base.num = 1;
+		context->time_base.den = 25;
+		context->gop_size     = 100;
+		context->max_b_frames = 0;
+		AVFrame  *frame  = av_frame_alloc();
+		AVPacket *packet = av_packet_alloc();
+		if(frame && packet && avcodec_open2(context, encoder, NULL) >= 0) {
+			frame->format = context->pix_fmt;
+			frame->width  = Width;
+			frame->height = Height;
+			for(int i = 0; i < Packets && av_frame_get_buffer(frame, 32) >= 0 && av_frame_make_writable(frame) >= 0; i++) {
+				// A gradient moving right: P frames with motion in them.
+				for(int p = 0; p < 3; p++) {
+					int w = p ? Width / 2 : Width, h = p ? Height / 2 : Height;
+					for(int y = 0; y < h; y++)
+						for(int x = 0; x < w; x++)
+							frame->data[p][y * frame->linesize[p] + x] = uint8_t(p ? 128 : (x + y + 3 * i) * 2);
+				}
+				frame->pts = i;
+				if(avcodec_send_frame(context, frame) < 0)
+					break;
+				while(avcodec_receive_packet(context, packet) >= 0) {
+					packets.push_back(vector<uint8_t>(packet->data, packet->data + packet->size));
+					av_packet_unref(packet);
+				}
+			}
+			avcodec_send_frame(context, NULL);
+			while(avcodec_receive_packet(context, packet) >= 0) {
+				packets.push_back(vector<uint8_t>(packet->data, packet->data + packet->size));
+				av_packet_unref(packet);
+			}
+		}
+		av_packet_free(&packet);
+		av_frame_free(&frame);
+		avcodec_free_context(&context);
+		return packets;
+	}
+
+	Atom *leaf(const char *name, const uint8_t *content, size_t size) {
+		Atom *atom = new Atom;
+		memcpy(atom->name, name, 4);
+		atom->content.assign(content, content + size);
+		return atom;
+	}
+
+	// Just what Codec::parse() and SampleCursor read: a single mp4v sample description and no samples.
+	Atom *mp4vTrak() {
+		static const uint8_t stsd[] = { 0,0,0,0, 0,0,0,1, 0,0,0,16, 'm','p','4','v' };
+		static const uint8_t stsz[] = { 0,0,0,0, 0,0,0,0, 0,0,0,0 };
+		static const uint8_t stsc[] = { 0,0,0,0, 0,0,0,0 };
+		static const uint8_t stco[] = { 0,0,0,0, 0,0,0,0 };
+		Atom *trak = new Atom;
+		memcpy(trak->name, "trak", 4);
+		trak->addChild(leaf("stsd", stsd, sizeof(stsd)));
+		trak->addChild(leaf("stsz", stsz, sizeof(stsz)));
+		trak->addChild(leaf("stsc", stsc, sizeof(stsc)));
+		trak->addChild(leaf("stco", stco, sizeof(stco)));
+		return trak;
+	}
+}
+
+
+int main() {
+	Log::setLevel(LogWarning);
+	avcodec_register_all();
+
+	vector<vector<uint8_t> > packets = encode();
+	if(packets.size() < size_t(Packets)) {
+		cerr << "FAIL: could not encode the test packets\n";
+		return 1;
+	}
+	// The packets back to back, as in an mdat, and the padding the decoders need.
+	vector<uint8_t> mdat_data;
+	for(size_t i = 0; i < packets.size(); i++)
+		mdat_data.insert(mdat_data.end(), packets[i].begin(), packets[i].end());
+	mdat_data.resize(mdat_data.size() + AV_INPUT_BUFFER_PADDING_SIZE, 0);
+	int total = int(mdat_data.size() - AV_INPUT_BUFFER_PADDING_SIZE);
+
+	// Start codes of a VOP, then noise.
+	vector<uint8_t> garbage(4096 + AV_INPUT_BUFFER_PADDING_SIZE, 0);
+	uint32_t seed = 12345;
+	for(size_t i = 0; i < garbage.size() - AV_INPUT_BUFFER_PADDING_SIZE; i++) {
+		seed = seed * 1103515245 + 12345;
+		garbage[i] = uint8_t(seed >> 16);
+	}
+	garbage[0] = 0; garbage[1] = 0; garbage[2] = 1; garbage[3] = 0xb6;
+
+	Atom *trak = mp4vTrak();
+	Atom  mdat;
+	memcpy(mdat.name, "mdat", 4);
+
+	Codec codec;
+	codec.codec   = avcodec_find_decoder(AV_CODEC_ID_MPEG4);
+	codec.context = codec.codec ? avcodec_alloc_context3(codec.codec) : NULL;
+	if(!codec.context || avcodec_open2(codec.context, codec.codec, NULL) < 0) {
+		cerr << "FAIL: could not open the mpeg4 decoder\n";
+		return 1;
+	}
+	SampleCursor samples(trak);
+	codec.parse(trak, samples, &mdat);
+
+	int failures = 0;
+	int offset   = 0;
+	for(int i = 0; i < Packets; i++) {
+		const uint8_t *start = &mdat_data[offset];
+		int maxlength = total - offset;
+		int duration  = 0;
+		int first     = codec.getLength(start, maxlength, duration);
+		codec.getLength(&garbage[0], int(garbage.size() - AV_INPUT_BUFFER_PADDING_SIZE), duration);
+		int second    = codec.getLength(start, maxlength, duration);
+		if(first != second) {
+			cerr << "FAIL: packet " << i << ": length " << first << ", then " << second
+				 << " after a failed probe\n";
+			failures++;
+		} else {
+			cout << "ok: packet " << i << ": length " << first << " (" << packets[i].size() << " encoded)\n";
+		}
+		offset += int(packets[i].size());
+	}
+
+	avcodec_free_context(&codec.context);
+	delete trak;
+	return failures ? 1 : 0;
+}
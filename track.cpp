@@ -25,6 +25,7 @@
 //#include <iomanip>
 #include <cstring>
 #include <cassert>
+#include <cmath>        // for: log()
 
 #ifndef __STDC_LIMIT_MACROS
 # define __STDC_LIMIT_MACROS    1
@@ -65,6 +66,11 @@ extern "C" {
 #define new         extern_new
 #define class       extern_class
 #include <libavcodec/h264dec.h>
+#ifndef av_export   // From libavutil/internal.h, for static linking.
+# define av_export
+#endif
+#include <libavcodec/aactab.h>
+#include <libavcodec/mpeg4audio.h>
 #undef class
 #undef new
 #undef _Atomic
@@ -73,87 +79,13 @@ extern "C" {
 
 #include "track.h"
 #include "atom.h"
+#include "byteorder.h"
+#include "log.h"
 
 
 using namespace std;
 
 
-// Additional output.
-#define VERBOSE         1
-
-
-namespace {
-	// Read an unaligned, big-endian value.
-	// A compiler will optimize this (at -O2) to a single instruction if possible.
-	template<class T>
-	static inline T readBE(const uint8_t *p, size_t i = 0) {
-		return (i >= sizeof(T)) ? T(0) :
-				(T(*p) << ((sizeof(T) - 1 - i) * 8)) | readBE<T>(p + 1, i + 1);
-	};
-
-	template<class T>
-	static inline void readBE(T &result, const uint8_t *p) { result = readBE<T>(p); };
-
-	// Write an unaligned, big-endian value.
-	template<class T>
-	static inline void writeBE(uint8_t *p, T value, size_t i = 0) {
-		(i >= sizeof(T)) ? void(0) :
-			(*p = ((value >> ((sizeof(T) - 1 - i) * 8)) & 0xFF) , writeBE(p + 1, value, i + 1));
-	};
-
-
-	// Configure FFmpeg/Libav logging for use in C++.
-	class AvLog {
-		int lvl;
-#ifdef AV_LOG_PRINT_LEVEL
-		int flgs;
-#endif
-	public:
-#ifdef AV_LOG_PRINT_LEVEL
-# define DEFAULT_AVLOG_FLAGS	AV_LOG_PRINT_LEVEL
-#else
-# define DEFAULT_AVLOG_FLAGS	0
-#endif
-
-		explicit AvLog()
-			: lvl(av_log_get_level())
-#ifdef AV_LOG_PRINT_LEVEL
-			, flgs(av_log_get_flags())
-#endif
-		{
-			av_log_set_flags(DEFAULT_AVLOG_FLAGS);
-			cout.flush();   // Flush C++ standard streams.
-			cerr.flush();   // Default unbuffered -> Flush in case this has changed.
-			clog.flush();
-		}
-
-		explicit AvLog(int level, int flags = DEFAULT_AVLOG_FLAGS)
-			: lvl(av_log_get_level())
-#ifdef AV_LOG_PRINT_LEVEL
-			, flgs(av_log_get_flags())
-#endif
-		{
-			if(lvl < level)
-				av_log_set_level(lvl);
-			av_log_set_flags(flags);
-			cout.flush();   // Flush C++ standard streams.
-			cerr.flush();   // Default unbuffered -> Flush in case this has changed.
-			clog.flush();
-		}
-
-		~AvLog() {
-			fflush(stdout); // Flush C stdio files.
-			fflush(stderr);
-			av_log_set_level(lvl);
-#ifdef AV_LOG_PRINT_LEVEL
-			av_log_set_flags(flgs);
-#endif
-		}
-	};
-}; // namespace
-
-
-
 // AVC1
 class H264sps {
 public:
@@ -260,10 +192,28 @@ public:
 	bool getNalInfo(const H264sps &sps, uint32_t maxlength, const uint8_t *buffer);
 	void clear();
 	void print(int indentation = 0);
+};
+
+
+// Reads the start of a NAL payload, dropping the emulation prevention bytes
+//  (0x000003 -> 0x0000) on the fly; bits past the end read as zero.
+// Only the slice header is needed, so nothing is copied.
+class NalBitReader {
+public:
+	NalBitReader(const uint8_t *data, const uint8_t *data_end)
+		: pos(data), end(data_end), cache(0), bits(0), zeros(0) { }
+
+	uint32_t readBits(int n);   // n <= 32.
+	int      golomb();          // Unsigned Exp-Golomb; -1 if too large.
 
 private:
-	static int golomb  (       uint8_t *&buffer, int &offset);
-	static int readBits(int n, uint8_t *&buffer, int &offset);
+	const uint8_t *pos;
+	const uint8_t *end;
+	uint64_t       cache;       // Unread bits, most significant first.
+	int            bits;        // Number of unread bits in cache.
+	int            zeros;       // Consecutive zero bytes just read.
+
+	void refill();
 };
 
 
@@ -305,135 +255,114 @@ void NalInfo::print(int indentation) {
 }
 
 
-int NalInfo::golomb(uint8_t *&buffer, int &offset) {
-	assert(buffer != NULL && offset >= 0 && offset < 8);
-	// Count the leading zeroes.
-	int count = 0;
-	while((*buffer & (0x01 << (7 - offset))) == 0) {
-		count++;
-		offset++;
-		if(offset == 8) {
-			buffer++;
-			offset = 0;
-		}
-		if(count > 20) {
-			cerr << "Failed reading golomb: too large!\n";
-			return -1;
+void NalBitReader::refill() {
+	while(bits <= 56) {
+		if(pos >= end) {
+			bits = 64;          // The cache is zero past the data.
+			return;
 		}
-	}
-	// Skip the single 1 delimiter.
-	offset++;
-	if(offset == 8) {
-		buffer++;
-		offset = 0;
-	}
-	uint32_t res = 1;
-	// Read count bits.
-	while(count-- > 0) {
-		res <<= 1;
-		res |= (*buffer & (0x01 << (7 - offset))) >> (7 - offset);
-		//res |= (*buffer >> (7 - offset)) & 0x01;
-		offset++;
-		if(offset == 8) {
-			buffer++;
-			offset = 0;
+		uint8_t byte = *pos++;
+		if(byte == 3 && zeros >= 2) {
+			zeros = 0;          // Emulation prevention byte.
+			continue;
 		}
+		zeros  = (byte == 0) ? zeros + 1 : 0;
+		cache |= uint64_t(byte) << (56 - bits);
+		bits  += 8;
 	}
-	return res - 1;
 }
 
-int NalInfo::readBits(int n, uint8_t *&buffer, int &offset) {
-	assert(buffer != NULL && offset >= 0);
-	int res = 0;
-	// Can't read in a single reading.
-	while(n + offset > 8) {
-		int d = 8 - offset;
-		res <<= d;
-		res |= *buffer & ((1 << d) - 1);
-		offset = 0;
-		buffer++;
-		n -= d;
-	}
-	// Read the remaining bits.
-	int d = (8 - offset - n);
-	res <<= n;
-	res |= (*buffer >> d) & ((1 << n) - 1);
+uint32_t NalBitReader::readBits(int n) {
+	assert(n >= 0 && n <= 32);
+	if(n == 0)
+		return 0;
+	if(bits < n)
+		refill();
+	uint32_t res = uint32_t(cache >> (64 - n));
+	cache <<= n;
+	bits   -= n;
 	return res;
 }
 
+int NalBitReader::golomb() {
+	if(bits < 41)
+		refill();
+	// Count the leading zeroes.
+#if defined(__GNUC__)
+	int count = cache ? __builtin_clzll(cache) : 64;
+#else
+	int count = 0;
+	while(count < 64 && !(cache & (uint64_t(1) << (63 - count))))
+		count++;
+#endif
+	if(count > 20) {
+		LOG(LogDebug) << "Failed reading golomb: too large!\n";
+		return -1;
+	}
+	// Skip the zeroes and the single 1 delimiter, then read count bits.
+	cache <<= count + 1;
+	bits   -= count + 1;
+	return int(((uint32_t(1) << count) | readBits(count)) - 1);
+}
+
 // Return false means this probably is not a NAL.
 bool NalInfo::getNalInfo(const H264sps &sps, uint32_t maxlength, const uint8_t *buffer) {
 	// Re-initialize.
 	clear();
 
 	if(buffer[0] != 0) {
-		cerr << "First byte expected 0.\n";
+		LOG(LogDebug) << "First byte expected 0.\n";
 		return false;
 	}
 
 	// This is supposed to be the length of the NAL unit.
 	uint32_t len = readBE<uint32_t>(buffer);
 	if(len > MaxAVC1Length) {
-		cerr << "Max length exceeded (" << len << " > " << MaxAVC1Length << ".\n";
+		LOG(LogDebug) << "Max length exceeded (" << len << " > " << MaxAVC1Length << ".\n";
 		return false;
 	}
 	if(len + 4 > maxlength) {
-		cerr << "Buffer size exceeded (" << (len + 4) << " > " << maxlength << ").\n";
+		LOG(LogDebug) << "Buffer size exceeded (" << (len + 4) << " > " << maxlength << ").\n";
 		return false;
 	}
 	length = len + 4;
-	cout << "Length         : " << length << '\n';
+	LOG(LogDebug) << "Length         : " << length << '\n';
 
 	buffer += 4;
 	if(*buffer & (1 << 7)) {
-		cerr << "Forbidden first bit 1.\n";
+		LOG(LogDebug) << "Forbidden first bit 1.\n";
 		return false;
 	}
 	ref_idc = *buffer >> 5;
-	cout << "Ref idc        : " << ref_idc << '\n';
+	LOG(LogDebug) << "Ref idc        : " << ref_idc << '\n';
 
 	nal_type = *buffer & 0x1f;
-	cout << "Nal type       : " << nal_type << '\n';
+	LOG(LogDebug) << "Nal type       : " << nal_type << '\n';
 	if(nal_type != 1 && nal_type != 5)
 		return true;
 
 	// Check if size is reasonable.
 	if(len < 8) {
-		cerr << "Length too short! (" << len << " < 8).\n";
+		LOG(LogDebug) << "Length too short! (" << len << " < 8).\n";
 		return false;
 	}
 
 	// Skip NAL header.
-	buffer++;
-
-	// Remove the emulation prevention 0x03 byte.
-	// Could be done in place to speed up things.
-	vector<uint8_t> data;
-	data.reserve(len);
-	for(unsigned int i = 0; i < len; i++) {
-		data.push_back(buffer[i]);
-		if(i+2 < len && buffer[i] == 0 && buffer[i+1] == 0 && buffer[i+2] == 3) {
-			data.push_back(buffer[i+1]);
-			assert(buffer[i+2] == 0x03);
-			i += 2; // Skipping 3 byte!
-		}
-	}
+	NalBitReader reader(buffer + 1, buffer + len);
 
-	uint8_t *start  = data.data();
-	int      offset = 0;
-	first_mb   = golomb(start, offset);
+	first_mb   = reader.golomb();
 	// TODO: Is there a max number, so we could validate?
-	cout << "First mb       : " << first_mb << '\n';
+	LOG(LogDebug) << "First mb       : " << first_mb << '\n';
 
-	slice_type = golomb(start, offset);
+	slice_type = reader.golomb();
 	if(slice_type > 9) {
-		cerr << "Invalid slice type (" << slice_type << "), probably this is not an avc1 sample.\n";
+		LOG(LogDebug) << "Invalid slice type (" << slice_type << "), probably this is not an avc1 sample.\n";
 		return false;
 	}
-	cout << "Slice type     : " << slice_type << '\n';
+	LOG(LogDebug) << "Slice type     : " << slice_type << '\n';
 
-	pps_id     = golomb(start, offset);
-	cout << "Pic parm set id: " << pps_id << '\n';
+	pps_id     = reader.golomb();
+	LOG(LogDebug) << "Pic parm set id: " << pps_id << '\n';
 	// pps id: should be taked from master context (h264_slice.c:1257).
 
 	// Assume separate colour plane flag is 0,
@@ -441,32 +370,32 @@ bool NalInfo::getNalInfo(const H264sps &sps, uint32_t maxlength, const uint8_t *
 
 	// Assuming same sps for all frames.
 	//SPS *sps = reinterpret_cast<SPS *>(h->ps.sps_list[0]->data);  // may_alias.
-	frame_num = readBits(sps.log2_max_frame_num, start, offset);
-	cout << "Frame number   : " << frame_num << '\n';
+	frame_num = reader.readBits(sps.log2_max_frame_num);
+	LOG(LogDebug) << "Frame number   : " << frame_num << '\n';
 
 	// Read 2 flags.
 	field_pic_flag  = 0;
 	bottom_pic_flag = 0;
-	if(sps.frame_mbs_only_flag) {
-		field_pic_flag = readBits(1, start, offset);
-		cout << "Field  pic flag: " << field_pic_flag << '\n';
+	if(!sps.frame_mbs_only_flag) {
+		field_pic_flag = reader.readBits(1);
+		LOG(LogDebug) << "Field  pic flag: " << field_pic_flag << '\n';
 		if(field_pic_flag) {
-			bottom_pic_flag = readBits(1, start, offset);
-			cout << "Bottom pic flag: " << bottom_pic_flag << '\n';
+			bottom_pic_flag = reader.readBits(1);
+			LOG(LogDebug) << "Bottom pic flag: " << bottom_pic_flag << '\n';
 		}
 	}
 
 	idr_pic_flag = (nal_type == 5) ? 1 : 0;
 	if (idr_pic_flag) {
-		idr_pic_id = golomb(start, offset);
-		cout << "Idr pic id     : " << idr_pic_id << '\n';
+		idr_pic_id = reader.golomb();
+		LOG(LogDebug) << "Idr pic id     : " << idr_pic_id << '\n';
 	}
 
 	// If the pic order count type == 0.
 	poc_type = sps.poc_type;
 	if(sps.poc_type == 0) {
-		poc_lsb = readBits(sps.log2_max_poc_lsb, start, offset);
-		cout << "Poc lsb        : " << poc_lsb << '\n';
+		poc_lsb = reader.readBits(sps.log2_max_poc_lsb);
+		LOG(LogDebug) << "Poc lsb        : " << poc_lsb << '\n';
 	}
 
 	// Ignoring the delta_poc for the moment.
@@ -475,58 +404,357 @@ bool NalInfo::getNalInfo(const H264sps &sps, uint32_t maxlength, const uint8_t *
 
 
 
-// Codec.
-Codec::Codec() : context(NULL), codec(NULL), mask1(0), mask0(0) { }
+// MP4A
+// Finds where an AAC-LC raw_data_block ends (ISO/IEC 14496-3, 4.4.2) by walking
+//  its syntax: section and scalefactor data and the Huffman codewords of the
+//  spectral data, without dequantising or synthesising anything.
+// HE-AAC needs nothing more, as SBR and PS data hide in fill elements.
+namespace {
+	const int AacMaxBlockSize = 1 << 16;    // Way over 6144 bits per channel and fill elements.
 
-void Codec::clear() {
-	name.clear();
-	// Do not remove the context, as it will be re-used!
-	codec   = NULL;
-	mask1   = 0;
-	mask0   = 0;
-}
+	// Huffman tables of the AAC decoder, indexed by codeword.
+	class AacTables {
+	public:
+		VLC     scalefactor;
+		VLC     spectral[11];
+		// Sign bits of each spectral codeword, plus 0x10/0x20 for escapes (codebook 11).
+		uint8_t extra_bits[11][17*17];
+
+		AacTables() {
+			init_vlc(&scalefactor, 7, 121,
+					 ff_aac_scalefactor_bits, 1, 1, ff_aac_scalefactor_code, 4, 4, 0);
+			for(int cb = 0; cb < 11; ++cb) {
+				init_vlc(&spectral[cb], 8, ff_aac_spectral_sizes[cb],
+						 ff_aac_spectral_bits[cb], 1, 1, ff_aac_spectral_codes[cb], 2, 2, 0);
+
+				// Codebooks 1, 2, 5 and 6 are signed; the others code absolute values.
+				bool unsigned_cb = cb != 0 && cb != 1 && cb != 4 && cb != 5;
+				int  dim  = cb < 4 ? 4 : 2;
+				int  base = cb < 4 ? 3 : cb < 6 ? 9 : cb < 8 ? 8 : cb < 10 ? 13 : 17;
+				for(int code = 0; code < ff_aac_spectral_sizes[cb]; ++code) {
+					uint8_t extra = 0;
+					for(int i = 0, rest = code; i < dim; ++i, rest /= base) {
+						int value = rest % base;
+						if(unsigned_cb && value)
+							++extra;
+						if(cb == ESC_BT - 1 && value == 16)
+							extra += 0x10 << (i & 1);
+					}
+					extra_bits[cb][code] = extra;
+				}
+			}
+		}
+	};
+	const AacTables aac_tables;
+
+	struct AacIcsInfo {
+		bool eight_short;
+		int  max_sfb;
+		int  num_swb;
+		int  num_window_groups;
+		int  group_len[8];
+		const uint16_t *swb_offset;
+	};
 
-bool Codec::parse(Atom *trak, vector<int> &offsets, Atom *mdat) {
-	Atom *stsd = trak->atomByName("stsd");
-	if(!stsd) {
-		cerr << "Missing 'Sample Descriptions' atom (stsd).\n";
-		return false;
+	// The same checks as the decoder (libavcodec/aacdec_template.c), where they cost nothing.
+	bool readIcsInfo(GetBitContext *gb, int sampling_index, AacIcsInfo &ics) {
+		if(get_bits1(gb))           // Reserved.
+			return false;
+		ics.eight_short = get_bits(gb, 2) == EIGHT_SHORT_SEQUENCE;
+		skip_bits1(gb);             // Window shape.
+		ics.num_window_groups = 1;
+		ics.group_len[0]      = 1;
+		if(ics.eight_short) {
+			ics.max_sfb    = get_bits(gb, 4);
+			for(int i = 0; i < 7; ++i) {
+				if(get_bits1(gb))
+					++ics.group_len[ics.num_window_groups - 1];
+				else
+					ics.group_len[ics.num_window_groups++] = 1;
+			}
+			ics.num_swb    = ff_aac_num_swb_128[sampling_index];
+			ics.swb_offset = ff_swb_offset_128[sampling_index];
+		} else {
+			ics.max_sfb    = get_bits(gb, 6);
+			if(get_bits1(gb))       // Prediction: not allowed in AAC-LC.
+				return false;
+			ics.num_swb    = ff_aac_num_swb_1024[sampling_index];
+			ics.swb_offset = ff_swb_offset_1024[sampling_index];
+		}
+		return ics.max_sfb <= ics.num_swb;
 	}
-	int32_t entries = stsd->readInt(4);
-	if(entries != 1)
-		throw string("Multiplexed streams not supported");
 
-	char codec_name[5];
-	stsd->readChar(codec_name, 12, 4);
-	name = codec_name;
+	bool skipChannelStream(GetBitContext *gb, int sampling_index, const AacIcsInfo *common_ics) {
+		int global_gain = get_bits(gb, 8);
+		AacIcsInfo ics;
+		if(common_ics)
+			ics = *common_ics;
+		else if(!readIcsInfo(gb, sampling_index, ics))
+			return false;
 
-	// This was a stupid attempt at trying to detect packet type based on bitmasks.
-	mask1 = 0xffffffff;
-	mask0 = 0xffffffff;
-	// Build the mask:
-	for(unsigned int i = 0; i < offsets.size(); i++) {
-		uint32_t offset = offsets[i];
-		if(offset < mdat->start || offset - mdat->start > mdat->length)
-			throw string("Invalid offset in track!");
+		// Section data: a codebook per scalefactor band.
+		uint8_t band_type[8][64];
+		int sect_bits = ics.eight_short ? 3 : 5;
+		int sect_esc  = (1 << sect_bits) - 1;
+		for(int g = 0; g < ics.num_window_groups; ++g) {
+			for(int k = 0; k < ics.max_sfb; ) {
+				int cb  = get_bits(gb, 4);
+				int len = 0;
+				int incr;
+				while((incr = get_bits(gb, sect_bits)) == sect_esc) {
+					len += sect_esc;
+					if(get_bits_left(gb) < 0)
+						return false;
+				}
+				len += incr;
+				if(cb == ESC_BT + 1 || k + len > ics.max_sfb || get_bits_left(gb) < 0)
+					return false;
+				memset(band_type[g] + k, cb, len);
+				k += len;
+			}
+		}
+
+		// Scalefactor data.
+		int  offset      = global_gain;
+		bool first_noise = true;
+		for(int g = 0; g < ics.num_window_groups; ++g) {
+			for(int sfb = 0; sfb < ics.max_sfb; ++sfb) {
+				int cb = band_type[g][sfb];
+				if(cb == ZERO_BT)
+					continue;
+				if(cb == NOISE_BT && first_noise) {
+					skip_bits(gb, 9);
+					first_noise = false;
+					continue;
+				}
+				int diff = get_vlc2(gb, aac_tables.scalefactor.table, 7, 3) - 60;
+				if(cb < NOISE_BT) {
+					offset += diff;
+					if(unsigned(offset) > 255)
+						return false;
+				}
+			}
+		}
+
+		if(get_bits1(gb)) {         // Pulse data.
+			if(ics.eight_short)
+				return false;
+			int num_pulse = get_bits(gb, 2) + 1;
+			int pulse_swb = get_bits(gb, 6);
+			if(pulse_swb >= ics.num_swb)
+				return false;
+			int pos = ics.swb_offset[pulse_swb];
+			for(int i = 0; i < num_pulse; ++i) {
+				pos += get_bits(gb, 5);
+				if(pos >= ics.swb_offset[ics.num_swb])
+					return false;
+				skip_bits(gb, 4);
+			}
+		}
+
+		if(get_bits1(gb)) {         // Temporal noise shaping data.
+			int is8 = ics.eight_short;
+			for(int w = 0; w < (is8 ? 8 : 1); ++w) {
+				int n_filt = get_bits(gb, 2 - is8);
+				if(!n_filt)
+					continue;
+				int coef_res = get_bits1(gb);
+				for(int filt = 0; filt < n_filt; ++filt) {
+					skip_bits(gb, 6 - 2 * is8);
+					int order = get_bits(gb, 5 - 2 * is8);
+					if(order > 12)
+						return false;
+					if(order) {
+						skip_bits1(gb);     // Direction.
+						int coef_len = coef_res + 3 - get_bits1(gb);
+						skip_bits_long(gb, order * coef_len);
+					}
+				}
+			}
+		}
 
-		int32_t s = mdat->readInt(offset - mdat->start - 8);
-		mask1 &=  s;
-		mask0 &= ~s;
+		if(get_bits1(gb))           // Gain control: AAC SSR only.
+			return false;
 
-		assert((s & mask1) == mask1);
-		assert((~s & mask0) == mask0);
+		// Spectral data.
+		for(int g = 0; g < ics.num_window_groups; ++g) {
+			for(int sfb = 0; sfb < ics.max_sfb; ++sfb) {
+				int cb = band_type[g][sfb];
+				if(cb == ZERO_BT || cb >= NOISE_BT)
+					continue;
+				int dim    = cb <= 4 ? 4 : 2;
+				int values = ics.group_len[g] * (ics.swb_offset[sfb + 1] - ics.swb_offset[sfb]);
+				const VLC     &vlc   = aac_tables.spectral[cb - 1];
+				const uint8_t *extra = aac_tables.extra_bits[cb - 1];
+				for(int i = 0; i < values; i += dim) {
+					int code = get_vlc2(gb, vlc.table, 8, 2);
+					if(code < 0)
+						return false;
+					skip_bits(gb, extra[code] & 0x0f);
+					for(int esc = extra[code] >> 4; esc; esc >>= 1) {
+						if(!(esc & 1))
+							continue;
+						int n = 4;
+						while(get_bits1(gb) && n < 13)
+							++n;
+						if(n == 13)
+							return false;
+						skip_bits(gb, n);
+					}
+				}
+				if(get_bits_left(gb) < 0)
+					return false;
+			}
+		}
+		return get_bits_left(gb) >= 0;
 	}
-	return true;
+
+	// Length in bytes of the raw_data_block at start, -1 if it is not one,
+	//  or 0 if it uses elements not handled here (coupling, program config).
+	int aacBlockLength(const AacInfo &aac, const uint8_t *start, int maxlength) {
+		// Channel elements of the channel configurations (14496-3, Table 1.19).
+		static const uint8_t expected_sce[8] = { 0, 1, 0, 1, 2, 1, 1, 1 };
+		static const uint8_t expected_cpe[8] = { 0, 0, 1, 1, 1, 2, 2, 3 };
+		static const uint8_t expected_lfe[8] = { 0, 0, 0, 0, 0, 0, 1, 1 };
+
+		// The bit reader may read a few bytes ahead: stay clear of the end of the data.
+		int size = maxlength - AV_INPUT_BUFFER_PADDING_SIZE;
+		if(size > AacMaxBlockSize)
+			size = AacMaxBlockSize;
+		GetBitContext gb;
+		if(size <= 0 || init_get_bits8(&gb, start, size) < 0)
+			return -1;
+
+		int sce = 0, cpe = 0, lfe = 0;
+		while(true) {
+			if(get_bits_left(&gb) < 3)
+				return -1;
+			int id = get_bits(&gb, 3);
+			if(id == TYPE_END)
+				break;
+
+			switch(id) {
+			case TYPE_SCE:
+			case TYPE_LFE:
+				skip_bits(&gb, 4);  // Element instance tag.
+				if(!skipChannelStream(&gb, aac.sampling_index, NULL))
+					return -1;
+				if(id == TYPE_SCE)
+					++sce;
+				else
+					++lfe;
+				break;
+			case TYPE_CPE: {
+				skip_bits(&gb, 4);
+				AacIcsInfo common;
+				bool common_window = get_bits1(&gb);
+				if(common_window) {
+					if(!readIcsInfo(&gb, aac.sampling_index, common))
+						return -1;
+					int ms_mask_present = get_bits(&gb, 2);
+					if(ms_mask_present == 3)
+						return -1;
+					if(ms_mask_present == 1)
+						skip_bits_long(&gb, common.num_window_groups * common.max_sfb);
+				}
+				for(int ch = 0; ch < 2; ++ch) {
+					if(!skipChannelStream(&gb, aac.sampling_index, common_window ? &common : NULL))
+						return -1;
+				}
+				++cpe;
+				break;
+			}
+			case TYPE_DSE: {
+				skip_bits(&gb, 4);
+				bool align = get_bits1(&gb);
+				int  count = get_bits(&gb, 8);
+				if(count == 255)
+					count += get_bits(&gb, 8);
+				if(align)
+					align_get_bits(&gb);
+				skip_bits_long(&gb, 8 * count);
+				break;
+			}
+			case TYPE_FIL: {
+				int count = get_bits(&gb, 4);
+				if(count == 15)
+					count += get_bits(&gb, 8) - 1;
+				skip_bits_long(&gb, 8 * count);
+				break;
+			}
+			default:                // TYPE_CCE, TYPE_PCE.
+				return 0;
+			}
+			if(get_bits_left(&gb) < 0)
+				return -1;
+		}
+
+		if(sce != expected_sce[aac.channel_config] || cpe != expected_cpe[aac.channel_config]
+		   || lfe != expected_lfe[aac.channel_config])
+			return -1;
+		return (get_bits_count(&gb) + 7) >> 3;
+	}
+}; // namespace
+
+
+
+// Codec handlers.
+// What to look for in the mdat depends on the codec: each sample description
+//  (stsd) name gets a handler, chosen once in Codec::parse().
+// The defaults match nothing.
+class CodecHandler {
+public:
+	virtual ~CodecHandler() { }
+
+	virtual bool matchSample(Codec &/*codec*/, const uint8_t * /*start*/, int /*maxlength*/) const { return false; }
+	virtual bool isKeyframe (Codec &/*codec*/, const uint8_t * /*start*/, int /*maxlength*/) const { return false; }
+	virtual int  getLength  (Codec &/*codec*/, const uint8_t * /*start*/, int /*maxlength*/, int &/*duration*/) const { return -1; }
+	// Packet types the model tells apart (0: none), and the type of the packet at start, or -1.
+	virtual int  packetTypes() const { return 0; }
+	virtual int  packetType (Codec &/*codec*/, const uint8_t * /*start*/, int /*maxlength*/) const { return -1; }
+
+	static const CodecHandler *find(const string &name);
+
+protected:
+	// Probe state of codec, reset for the next decode.
+	// Every probe is a trial of its own: resetDecoder() drops what earlier ones left in the decoder.
+	static void      resetDecoder(Codec &codec) { avcodec_flush_buffers(codec.context); }
+	static AVFrame  *probeFrame (Codec &codec);
+	static AVPacket *probePacket(Codec &codec, const uint8_t *data, int size);
+	static AacInfo  &aacInfo    (Codec &codec) { return codec.aac; }
+};
+
+AVFrame *CodecHandler::probeFrame(Codec &codec) {
+	if(!codec.probe_frame) {
+		codec.probe_frame = av_frame_alloc();
+		if(!codec.probe_frame)
+			throw string("Could not create AVFrame");
+	} else
+		av_frame_unref(codec.probe_frame);
+	return codec.probe_frame;
 }
 
+AVPacket *CodecHandler::probePacket(Codec &codec, const uint8_t *data, int size) {
+	if(!codec.probe_packet) {
+		codec.probe_packet = av_packet_alloc();
+		if(!codec.probe_packet)
+			throw string("Could not create AVPacket");
+	}
+	// Not reference counted: only points into the mdat, which the decoder only reads.
+	codec.probe_packet->data = const_cast<uint8_t *>(data);
+	codec.probe_packet->size = size;
+	return codec.probe_packet;
+}
 
-bool Codec::matchSample(const unsigned char *start, int maxlength) {
-	int32_t s = readBE<int32_t>(start);
 
-	if(name == "avc1") {
+namespace {
+class Avc1Codec : public CodecHandler {
+public:
+	bool matchSample(Codec &/*codec*/, const uint8_t *start, int /*maxlength*/) const {
 		// This works only for a very specific kind of video.
 		//#define SPECIAL_VIDEO
 #ifdef SPECIAL_VIDEO
+		int32_t s  = readBE<int32_t>(start);
 		int32_t s2 = readBE<int32_t>(start + 4);
 		if(s != 0x00000002 || (s2 != 0x09300000 && s2 != 0x09100000))
 			return false;
@@ -538,245 +766,70 @@ bool Codec::matchSample(const unsigned char *start, int maxlength) {
 		// The other values are really uncommon on cameras...
 		if(nal_type > 21) {
 		//if(nal_type != 1 && !(nal_type >= 5 && nal_type <= 12)) {
-#ifdef VERBOSE
-			cout << "avc1: No match because of NAL type: " << nal_type << '\n';
-#endif
+			LOG(LogDebug) << "avc1: No match because of NAL type: " << nal_type << '\n';
 			return false;
 		}
 		// If NAL is equal 7, the other fragments (starting with NAL type 7)
 		//  should be part of the same packet.
 		// (We cannot recover time information, remember.)
 		if(start[0] == 0) {
-#ifdef VERBOSE
-			cout << "avc1: Match with 0 header.\n";
-#endif
-			return true;
-		}
-#ifdef VERBOSE
-		cout << "avc1: Failed for no particular reason.\n";
-#endif
-		return false;
-
-	} else if(name == "mp4a") {
-		if(s > 1000000) {
-#ifdef VERBOSE
-			cout << "mp4a: Success because of large s value.\n";
-#endif
-			return true;
-		}
-		// XXX Horrible Hack: These values might need to be changed depending on the file. XXX
-		if((start[4] == 0xee && start[5] == 0x1b) ||
-		   (start[4] == 0x3e && start[5] == 0x64) )
-		{
-			cout << "mp4a: Success because of horrible hack.\n";
+			LOG(LogDebug) << "avc1: Match with 0 header.\n";
 			return true;
 		}
-
-		if(start[0] == 0) {
-#ifdef VERBOSE
-			cout << "mp4a: Failure because of NULL header.\n";
-#endif
-			return false;
-		}
-#ifdef VERBOSE
-		cout << "mp4a: Success for no particular reason....\n";
-#endif
-		return true;
-
-#if 0 // THIS is true for mp3...
-		// From: MP3'Tech Programmer's corner <http://www.mp3-tech.org/>.
-		// MPEG Audio Layer I/II/III frame header (MSB->LSB):
-		// BitPos   Length Use
-		//  31-21  11 bits Frame sync [all bits are 1],
-		//  20-19   2 bits MPEG Audio version Id [11=v1, 10=v2, 01=reserved, 00=v2.5+],
-		//  18-17   2 bits Layer [11=I, 10=II, 01=III, 00=reserved],
-		//     16   1 bit  Protection [1=unprotected, 0=16-bit CRC after this header],
-		//  15-12   4 bits Bitrate index (variable for VBR) [0000=free, .., 1111=bad],
-		//  11-10   2 bits Sampling rate frequency index [.., 11=reserved],
-		//      9   1 bit  Padding (might be variable) [0=unpadded, 1=extra 32bit (L1) or 8bit (L2/L3)],
-		//      8   1 bit  Private (???) [=0 ???],
-		//   7- 6   2 bits Channel mode (constant) [00=Stereo, 01=Joint Stereo, 10=Dual Mono, 11=Single Mono],
-		//   5- 4   2 bits Mode extension for Joint Stereo (variable),
-		//      3   1 bit  Copyright [0=Not-Copyrighted, 1=Copyrighted],
-		//      2   1 bit  Original [0=Copy, 1=Original Media],
-		//   1- 0   2 bits Emphasis (variable) [00=None, 01=50/15 ms, 10=reserved, 11=CCIT J.17].
-		// In practice we have:
-		//  mask = 11111111111 11 11 1 0000 11 0 0 11 11 1 1 11
-		//       = 1111 1111 1111 1111 0000 1100 1111 1111
-		//       = 0xFFFF0CFF
-		reverse(s);
-		if(s & 0xFFE00000 != 0xFFE00000) // Check frame sync.
-			return false;
-		return true;
-#endif
-
-	} else if(name == "mp4v") {
-		// As far as I know, keyframes are 1b3 and frames are 1b6 (ISO/IEC 14496-2, 6.3.4 6.3.5).
-		if(s == 0x1b3 || s == 0x1b6)
-			return true;
-		return false;
-
-	} else if(name == "alac") {
-		int32_t t = readBE<int32_t>(start + 4);
-		t &= 0xffff0000;
-
-		if(s == 0      && t == 0x00130000) return true;
-		if(s == 0x1000 && t == 0x001a0000) return true;
-		return false;
-
-	} else if(name == "samr") {
-		return start[0] == 0x3c;
-
-	} else if(name == "twos") {
-		// Weird audio codec: each packet is 2 signed 16b integers.
-		cerr << "The Twos audio codec is EVIL, there is no hope to guess it.\n";
-		throw "Encountered an EVIL audio codec";
-		return true;
-
-	} else if(name == "apcn") {
-		return memcmp(start, "icpf", 4) == 0;
-
-	} else if(name == "lpcm") {
-		// This is not trivial to detect, because it is just
-		// the audio waveform encoded as signed 16-bit integers.
-		// For now, just test that it is not "apcn" video.
-		return memcmp(start, "icpf", 4) != 0;
-
-	} else if(name == "in24") {
-		// It's a codec id, in a case I found a pcm_s24le (little endian 24 bit).
-		// No way to know it's length.
-		return true;
-
-	} else if(name == "sowt") {
-		cerr << "Sowt is just raw data, no way to guess length (unless reliably detecting the other codec start).\n";
+		LOG(LogDebug) << "avc1: Failed for no particular reason.\n";
 		return false;
 	}
 
-	return false;
-}
-
-
-int Codec::getLength(unsigned char *start, int maxlength, int &duration) {
-	if(name == "mp4a") {
-		if(!context)
+	int getLength(Codec &codec, const uint8_t *start, int maxlength, int &/*duration*/) const {
+		if(!codec.context)
 			return -1;
-		int consumed = -1;
-		{
-			AvLog useAvLog();
-			AVFrame *frame = av_frame_alloc();
-			if(!frame)
-				throw string("Could not create AVFrame");
-			AVPacket avp;
-			av_init_packet(&avp);
-			avp.data = start;
-			avp.size = maxlength;
-			int got_frame = 0;
-			consumed = avcodec_decode_audio4(context, frame, &got_frame, &avp);
-			if(consumed >= 0) {
-				if(frame->nb_samples > 0)
-					duration = frame->nb_samples;
-				// Flush decoder to receive buffered packets.
-				if(consumed <= 0 || duration <= 0) {
-					clog << "Flush " << name << " decoder.\n";
-					got_frame = 0;
-					av_packet_unref(&avp);
-					av_frame_unref(frame);
-					int consumed2 = avcodec_decode_audio4(context, frame, &got_frame, &avp);
-					if(consumed2 >= 0) {
-						if(consumed <= 0)
-							consumed = consumed2;
-						if(duration <= 0 && frame->nb_samples > 0)
-							duration = frame->nb_samples;
-					}
-				}
+
+		// XXX: Horrible Hack: Referencing unstable, internal data structures. XXX
+		H264Context *h    = static_cast<H264Context*>(codec.context->priv_data); //codec.context->codec->
+		const SPS   *hsps = NULL;
+		if(h) {
+			// Use currently active SPS.
+			//hsps = h->ps.sps;
+			if(!hsps && h->ps.sps_list[0]) {
+				// Use first SPS.
+				hsps = reinterpret_cast<const SPS*>(h->ps.sps_list[0]->data); // may_alias.
 			}
-			av_packet_unref(&avp);
-			av_frame_free(&frame);
 		}
-		cout << "Duration: " << duration << '\n';
-		return consumed;
-
-	} else if(name == "mp4v") {
-		if(!context)
+		if(!hsps) {
+			LOG(LogWarning) << "Could not retrieve SPS.\n";
+			//throw string("Could not retrieve SPS");
 			return -1;
+		}
+		H264sps sps(*hsps);
+
+#if 0
 		int consumed = -1;
 		{
-			AvLog useAvLog();
 			AVFrame *frame = av_frame_alloc();
 			if(!frame)
 				throw string("Could not create AVFrame");
 			AVPacket avp;
 			av_init_packet(&avp);
-			avp.data = start;
+			avp.data = const_cast<uint8_t *>(start);   // Only read by the decoder.
 			avp.size = maxlength;
 			int got_frame = 0;
-			consumed = avcodec_decode_video2(context, frame, &got_frame, &avp);
+			consumed = avcodec_decode_video2(codec.context, frame, &got_frame, &avp);
 			if(consumed == 0) {
 				// Flush decoder to receive buffered packets.
-				clog << "Flush " << name << " decoder.\n";
+				LOG(LogDebug) << "Flush " << codec.name << " decoder.\n";
 				got_frame = 0;
 				av_packet_unref(&avp);
 				av_frame_unref(frame);
-				int consumed2 = avcodec_decode_video2(context, frame, &got_frame, &avp);
+				int consumed2 = avcodec_decode_video2(codec.context, frame, &got_frame, &avp);
 				if(consumed2 >= 0)
 					consumed = consumed2;
 			}
 			av_packet_unref(&avp);
 			av_frame_free(&frame);
 		}
+		//clog << "Consumed: " << consumed << '\n';
 		return consumed;
-
-	} else if(name == "avc1") {
-		if(!context)
-			return -1;
-
-		// XXX: Horrible Hack: Referencing unstable, internal data structures. XXX
-		H264Context *h    = static_cast<H264Context*>(context->priv_data); //context->codec->
-		const SPS   *hsps = NULL;
-		if(h) {
-			// Use currently active SPS.
-			//hsps = h->ps.sps;
-			if(!hsps && h->ps.sps_list[0]) {
-				// Use first SPS.
-				hsps = reinterpret_cast<const SPS*>(h->ps.sps_list[0]->data); // may_alias.
-			}
-		}
-		if(!hsps) {
-			cerr << "Could not retrieve SPS.\n";
-			//throw string("Could not retrieve SPS");
-			return -1;
-		}
-		H264sps sps(*hsps);
-
-#if 0
-		int consumed = -1;
-		{
-			AvLog useAvLog();
-			AVFrame *frame = av_frame_alloc();
-			if(!frame)
-				throw string("Could not create AVFrame");
-			AVPacket avp;
-			av_init_packet(&avp);
-			avp.data = start;
-			avp.size = maxlength;
-			int got_frame = 0;
-			consumed = avcodec_decode_video2(context, frame, &got_frame, &avp);
-			if(consumed == 0) {
-				// Flush decoder to receive buffered packets.
-				clog << "Flush " << name << " decoder.\n";
-				got_frame = 0;
-				av_packet_unref(&avp);
-				av_frame_unref(frame);
-				int consumed2 = avcodec_decode_video2(context, frame, &got_frame, &avp);
-				if(consumed2 >= 0)
-					consumed = consumed2;
-			}
-			av_packet_unref(&avp);
-			av_frame_free(&frame);
-		}
-		//clog << "Consumed: " << consumed << '\n';
-		return consumed;
-#endif
+#endif
 
 		// NAL unit types
 		//  see: libavcodec/h264.h
@@ -819,7 +872,7 @@ int Codec::getLength(unsigned char *start, int maxlength, int &duration) {
 		bool    seen_slice = false;
 
 		while(true) {
-			cout << '\n';
+			LOG(LogDebug) << '\n';
 			NalInfo info;
 			bool ok = info.getNalInfo(sps, maxlength, pos);
 			if(!ok)
@@ -834,11 +887,11 @@ int Codec::getLength(unsigned char *start, int maxlength, int &duration) {
 				} else {
 					// Check for changes.
 					if(previous.frame_num != info.frame_num) {
-						cout << "Different frame number.\n";
+						LOG(LogDebug) << "Different frame number.\n";
 						return length;
 					}
 					if(previous.pps_id != info.pps_id) {
-						cout << "Different pic parameter set id.\n";
+						LOG(LogDebug) << "Different pic parameter set id.\n";
 						return length;
 					}
 					// All these conditions are listed in the docs, but
@@ -847,36 +900,36 @@ int Codec::getLength(unsigned char *start, int maxlength, int &duration) {
 					//#define STRICT_NAL_INFO_CHECKING  1
 #ifdef STRICT_NAL_INFO_CHECKING
 					if(previous.field_pic_flag != info.field_pic_flag) {
-						cout << "Different field  pic flag.\n";
+						LOG(LogDebug) << "Different field  pic flag.\n";
 						return length;
 					}
 					if(previous.field_pic_flag && info.field_pic_flag
 					   && previous.bottom_pic_flag != info.bottom_pic_flag)
 					{
-						cout << "Different bottom pic flag.\n";
+						LOG(LogDebug) << "Different bottom pic flag.\n";
 						return length;
 					}
 #endif
 					if(previous.ref_idc != info.ref_idc) {
-						cout << "Different ref idc.\n";
+						LOG(LogDebug) << "Different ref idc.\n";
 						return length;
 					}
 #ifdef STRICT_NAL_INFO_CHECKING
 					if(previous.poc_type == 0 && info.poc_type == 0
 					   && previous.poc_lsb != info.poc_lsb)
 					{
-						cout << "Different pic order count lsb (poc lsb).\n";
+						LOG(LogDebug) << "Different pic order count lsb (poc lsb).\n";
 						return length;
 					}
 #endif
 					if(previous.idr_pic_flag != info.idr_pic_flag) {
-						cout << "Different NAL type (5, 1).\n";
+						LOG(LogDebug) << "Different NAL type (5, 1).\n";
 					}
 #ifdef STRICT_NAL_INFO_CHECKING
 					if(previous.idr_pic_flag == 1 && info.idr_pic_flag == 1
 					   && previous.idr_pic_id != info.idr_pic_id)
 					{
-						cout << "Different idr pic id for keyframe.\n";
+						LOG(LogDebug) << "Different idr pic id for keyframe.\n";
 						return length;
 					}
 #endif
@@ -884,7 +937,7 @@ int Codec::getLength(unsigned char *start, int maxlength, int &duration) {
 				break;
 			default:
 				if(seen_slice) {
-					cerr << "New access unit since seen picture.\n";
+					LOG(LogDebug) << "New access unit since seen picture.\n";
 					return length;
 				}
 				break;
@@ -892,42 +945,537 @@ int Codec::getLength(unsigned char *start, int maxlength, int &duration) {
 			pos       += info.length;
 			length    += info.length;
 			maxlength -= info.length;
-			cout << "Partial length : " << length << '\n';
+			LOG(LogDebug) << "Partial length : " << length << '\n';
 		}
 		return length;
+	}
+
+	bool isKeyframe(Codec &/*codec*/, const uint8_t *start, int /*maxlength*/) const {
+		// First byte of the NAL, the last 5 bits determine type
+		//   (usually 5 for keyframe, 1 for intra frame).
+		return (start[4] & 0x1F) == 5;
+	}
+
+	int packetTypes() const { return 32; }
+	int packetType(Codec &/*codec*/, const uint8_t *start, int maxlength) const {
+		// Type of the first NAL.
+		return (maxlength > 4) ? (start[4] & 0x1f) : -1;
+	}
+};
+
+class Mp4aCodec : public CodecHandler {
+public:
+	bool matchSample(Codec &/*codec*/, const uint8_t *start, int /*maxlength*/) const {
+		int32_t s = readBE<int32_t>(start);
+		if(s > 1000000) {
+			LOG(LogDebug) << "mp4a: Success because of large s value.\n";
+			return true;
+		}
+		// XXX Horrible Hack: These values might need to be changed depending on the file. XXX
+		if((start[4] == 0xee && start[5] == 0x1b) ||
+		   (start[4] == 0x3e && start[5] == 0x64) )
+		{
+			LOG(LogDebug) << "mp4a: Success because of horrible hack.\n";
+			return true;
+		}
+
+		if(start[0] == 0) {
+			LOG(LogDebug) << "mp4a: Failure because of NULL header.\n";
+			return false;
+		}
+		LOG(LogDebug) << "mp4a: Success for no particular reason....\n";
+		return true;
+
+#if 0 // THIS is true for mp3...
+		// From: MP3'Tech Programmer's corner <http://www.mp3-tech.org/>.
+		// MPEG Audio Layer I/II/III frame header (MSB->LSB):
+		// BitPos   Length Use
+		//  31-21  11 bits Frame sync [all bits are 1],
+		//  20-19   2 bits MPEG Audio version Id [11=v1, 10=v2, 01=reserved, 00=v2.5+],
+		//  18-17   2 bits Layer [11=I, 10=II, 01=III, 00=reserved],
+		//     16   1 bit  Protection [1=unprotected, 0=16-bit CRC after this header],
+		//  15-12   4 bits Bitrate index (variable for VBR) [0000=free, .., 1111=bad],
+		//  11-10   2 bits Sampling rate frequency index [.., 11=reserved],
+		//      9   1 bit  Padding (might be variable) [0=unpadded, 1=extra 32bit (L1) or 8bit (L2/L3)],
+		//      8   1 bit  Private (???) [=0 ???],
+		//   7- 6   2 bits Channel mode (constant) [00=Stereo, 01=Joint Stereo, 10=Dual Mono, 11=Single Mono],
+		//   5- 4   2 bits Mode extension for Joint Stereo (variable),
+		//      3   1 bit  Copyright [0=Not-Copyrighted, 1=Copyrighted],
+		//      2   1 bit  Original [0=Copy, 1=Original Media],
+		//   1- 0   2 bits Emphasis (variable) [00=None, 01=50/15 ms, 10=reserved, 11=CCIT J.17].
+		// In practice we have:
+		//  mask = 11111111111 11 11 1 0000 11 0 0 11 11 1 1 11
+		//       = 1111 1111 1111 1111 0000 1100 1111 1111
+		//       = 0xFFFF0CFF
+		reverse(s);
+		if(s & 0xFFE00000 != 0xFFE00000) // Check frame sync.
+			return false;
+		return true;
+#endif
+	}
+
+	// The block walker is trusted once it agreed with the decoder on this many packets in a row.
+	static const int AacChecks = 16;
+	// Even then the decoder checks every this many lengths, and any length
+	//  outside the sizes of the reference packets.
+	static const int AacRecheck = 32;
+
+	int getLength(Codec &codec, const uint8_t *start, int maxlength, int &duration) const {
+		if(!codec.context)
+			return -1;
+		AacInfo &aac = aacInfo(codec);
+		if(!aac.parsed())
+			parseConfig(codec, aac);
+
+		int length = aac.sampling_index >= 0 ? aacBlockLength(aac, start, maxlength) : 0;
+		if(length < 0 && aac.checked >= AacChecks)
+			return length;
+		if(length > 0 && aac.checked >= AacChecks && aac.trusted < AacRecheck && usualSize(codec, length)) {
+			++aac.trusted;
+			duration = aac.frame_samples;
+			return length;
+		}
 
-	} else if(name == "samr") {
+		aac.trusted  = 0;
+		int consumed = decodeLength(codec, start, maxlength, duration);
+		if(length != 0 && consumed > 0 && duration > 0) {
+			if(length == consumed && duration == aac.frame_samples) {
+				++aac.checked;
+			} else if(length == consumed || length < 0) {
+				// The frame size changed (implicit SBR), or the decoder took what
+				//  the walker did not: start counting again.
+				aac.checked       = 0;
+				aac.frame_samples = duration;
+			} else {
+				LOG(LogVerbose) << "AAC block length " << length << " differs from the decoder's "
+								<< consumed << ": decoding every packet.\n";
+				aac.sampling_index = -1;
+			}
+		}
+		return consumed;
+	}
+
+private:
+	static bool usualSize(const Codec &codec, int length) {
+		const PacketModel &model = codec.model;
+		return model.samples == 0 || (length >= model.min_size && length <= model.max_size);
+	}
+
+	// Walk the blocks only for AAC-LC (possibly with SBR/PS) with a standard channel configuration.
+	void parseConfig(Codec &codec, AacInfo &aac) const {
+		aac.sampling_index = -1;
+		MPEG4AudioConfig config = MPEG4AudioConfig();
+		AVCodecContext *context = codec.context;
+		if(!context->extradata || avpriv_mpeg4audio_get_config(&config, context->extradata,
+		                                                       context->extradata_size * 8, 1) < 0)
+			return;
+		if(config.object_type != AOT_AAC_LC || config.frame_length_short
+		   || config.sampling_index > 12 || config.chan_config < 1 || config.chan_config > 7)
+			return;
+		aac.sampling_index = config.sampling_index;
+		aac.channel_config = config.chan_config;
+	}
+
+	// Full decode: slow, but handles everything.
+	int decodeLength(Codec &codec, const uint8_t *start, int maxlength, int &duration) const {
+		resetDecoder(codec);
+		AVFrame  *frame = probeFrame(codec);
+		AVPacket *avp   = probePacket(codec, start, maxlength);
+		int got_frame = 0;
+		int consumed  = avcodec_decode_audio4(codec.context, frame, &got_frame, avp);
+		if(consumed >= 0) {
+			if(frame->nb_samples > 0)
+				duration = frame->nb_samples;
+			// Flush decoder to receive buffered packets.
+			if(consumed <= 0 || duration <= 0) {
+				LOG(LogDebug) << "Flush " << codec.name << " decoder.\n";
+				got_frame = 0;
+				frame = probeFrame(codec);
+				avp   = probePacket(codec, NULL, 0);
+				int consumed2 = avcodec_decode_audio4(codec.context, frame, &got_frame, avp);
+				if(consumed2 >= 0) {
+					if(consumed <= 0)
+						consumed = consumed2;
+					if(duration <= 0 && frame->nb_samples > 0)
+						duration = frame->nb_samples;
+				}
+			}
+		}
+		LOG(LogDebug) << "Duration: " << duration << '\n';
+		return consumed;
+	}
+};
+
+class Mp4vCodec : public CodecHandler {
+public:
+	bool matchSample(Codec &/*codec*/, const uint8_t *start, int /*maxlength*/) const {
+		int32_t s = readBE<int32_t>(start);
+		// As far as I know, keyframes are 1b3 and frames are 1b6 (ISO/IEC 14496-2, 6.3.4 6.3.5).
+		if(s == 0x1b3 || s == 0x1b6)
+			return true;
+		return false;
+	}
+
+	int getLength(Codec &codec, const uint8_t *start, int maxlength, int &/*duration*/) const {
+		if(!codec.context)
+			return -1;
+		resetDecoder(codec);
+		AVFrame  *frame = probeFrame(codec);
+		AVPacket *avp   = probePacket(codec, start, maxlength);
+		int got_frame = 0;
+		int consumed  = avcodec_decode_video2(codec.context, frame, &got_frame, avp);
+		if(consumed == 0) {
+			// Flush decoder to receive buffered packets.
+			LOG(LogDebug) << "Flush " << codec.name << " decoder.\n";
+			got_frame = 0;
+			frame = probeFrame(codec);
+			avp   = probePacket(codec, NULL, 0);
+			int consumed2 = avcodec_decode_video2(codec.context, frame, &got_frame, avp);
+			if(consumed2 >= 0)
+				consumed = consumed2;
+		}
+		return consumed;
+	}
+};
+
+class AlacCodec : public CodecHandler {
+public:
+	bool matchSample(Codec &/*codec*/, const uint8_t *start, int /*maxlength*/) const {
+		int32_t s = readBE<int32_t>(start);
+		int32_t t = readBE<int32_t>(start + 4);
+		t &= 0xffff0000;
+
+		if(s == 0      && t == 0x00130000) return true;
+		if(s == 0x1000 && t == 0x001a0000) return true;
+		return false;
+	}
+};
+
+class SamrCodec : public CodecHandler {
+public:
+	bool matchSample(Codec &/*codec*/, const uint8_t *start, int /*maxlength*/) const {
+		return start[0] == 0x3c;
+	}
+
+	int getLength(Codec &/*codec*/, const uint8_t * /*start*/, int /*maxlength*/, int &/*duration*/) const {
 		// Lenght is a multiple of 32, we split packets.
 		return 32;
+	}
+};
+
+class TwosCodec : public CodecHandler {
+public:
+	bool matchSample(Codec &/*codec*/, const uint8_t * /*start*/, int /*maxlength*/) const {
+		// Weird audio codec: each packet is 2 signed 16b integers.
+		cerr << "The Twos audio codec is EVIL, there is no hope to guess it.\n";
+		throw "Encountered an EVIL audio codec";
+		return true;
+	}
 
-	} else if(name == "twos") {
+	int getLength(Codec &/*codec*/, const uint8_t * /*start*/, int /*maxlength*/, int &/*duration*/) const {
 		// Lenght is a multiple of 32, we split packets.
 		return 4;
+	}
+};
 
-	} else if(name == "apcn") {
+class ApcnCodec : public CodecHandler {
+public:
+	bool matchSample(Codec &/*codec*/, const uint8_t *start, int /*maxlength*/) const {
+		return memcmp(start, "icpf", 4) == 0;
+	}
+
+	int getLength(Codec &/*codec*/, const uint8_t *start, int /*maxlength*/, int &/*duration*/) const {
 		return readBE<int32_t>(start);
+	}
+};
 
-	} else if(name == "lpcm") {
+class LpcmCodec : public CodecHandler {
+public:
+	bool matchSample(Codec &/*codec*/, const uint8_t *start, int /*maxlength*/) const {
+		// This is not trivial to detect, because it is just
+		// the audio waveform encoded as signed 16-bit integers.
+		// For now, just test that it is not "apcn" video.
+		return memcmp(start, "icpf", 4) != 0;
+	}
+
+	int getLength(Codec &/*codec*/, const uint8_t * /*start*/, int /*maxlength*/, int &/*duration*/) const {
 		// Use hard-coded values for now....
 		const int num_samples      = 4096; // Empirical
 		const int num_channels     =    2; // Stereo
 		const int bytes_per_sample =    2; // 16-bit
 		return num_samples * num_channels * bytes_per_sample;
+	}
+};
 
-	} else if(name == "in24") {
-		return -1;
+class In24Codec : public CodecHandler {
+public:
+	bool matchSample(Codec &/*codec*/, const uint8_t * /*start*/, int /*maxlength*/) const {
+		// It's a codec id, in a case I found a pcm_s24le (little endian 24 bit).
+		// No way to know it's length.
+		return true;
+	}
 
-	} else
+	int getLength(Codec &/*codec*/, const uint8_t * /*start*/, int /*maxlength*/, int &/*duration*/) const {
 		return -1;
+	}
+};
+
+class SowtCodec : public CodecHandler {
+public:
+	bool matchSample(Codec &/*codec*/, const uint8_t * /*start*/, int /*maxlength*/) const {
+		cerr << "Sowt is just raw data, no way to guess length (unless reliably detecting the other codec start).\n";
+		return false;
+	}
+};
+
+// At namespace scope the handlers are constructed before main(), so before any
+//  thread can look one up.
+const CodecHandler UnknownHandler;
+const Avc1Codec    Avc1Handler;
+const Mp4aCodec    Mp4aHandler;
+const Mp4vCodec    Mp4vHandler;
+const AlacCodec    AlacHandler;
+const SamrCodec    SamrHandler;
+const TwosCodec    TwosHandler;
+const ApcnCodec    ApcnHandler;
+const LpcmCodec    LpcmHandler;
+const In24Codec    In24Handler;
+const SowtCodec    SowtHandler;
+
+const struct {
+	const char         *name;
+	const CodecHandler *handler;
+} Handlers[] = {
+	{ "avc1", &Avc1Handler }, { "mp4a", &Mp4aHandler }, { "mp4v", &Mp4vHandler }, { "alac", &AlacHandler },
+	{ "samr", &SamrHandler }, { "twos", &TwosHandler }, { "apcn", &ApcnHandler }, { "lpcm", &LpcmHandler },
+	{ "in24", &In24Handler }, { "sowt", &SowtHandler },
+};
+}; // namespace
+
+
+const CodecHandler *CodecHandler::find(const string &name) {
+	for(unsigned int i = 0; i < sizeof(Handlers)/sizeof(Handlers[0]); ++i) {
+		if(name == Handlers[i].name)
+			return Handlers[i].handler;
+	}
+	return &UnknownHandler;
 }
 
-bool Codec::isKeyframe(const unsigned char *start, int maxlength) {
-	if(name == "avc1") {
-		// First byte of the NAL, the last 5 bits determine type
-		//   (usually 5 for keyframe, 1 for intra frame).
-		return (start[4] & 0x1F) == 5;
-	} else
+
+
+// Packet model.
+namespace {
+	// Reference packets needed before a lead byte or type never seen among them
+	//  makes a packet unlikely.
+	const int MinModelSamples = 256;
+
+	int sizeBucket(int size) {
+		int bucket = 0;
+		while(size > 1 && bucket < 31) {
+			size >>= 1;
+			bucket++;
+		}
+		return bucket;
+	}
+
+	// Log of the frequency of a value seen count times in total, over the
+	//  frequency of each of values equally likely ones (add-one smoothed).
+	double logRatio(int count, int total, int values) {
+		return log(double(count + 1) * values / (total + values));
+	}
+}
+
+void PacketModel::add(int lead, int type, int size) {
+	if(leads.empty()) {
+		leads.assign(256, 0);
+		sizes.assign(32, 0);
+	}
+	if(samples == 0 || size < min_size)
+		min_size = size;
+	if(size > max_size)
+		max_size = size;
+	samples++;
+	leads[lead]++;
+	if(type >= 0 && type < int(types.size()))
+		types[type]++;
+	sizes[sizeBucket(size)]++;
+}
+
+double PacketModel::score(int lead, int type) const {
+	if(samples == 0)
+		return 0;
+	double s = logRatio(leads[lead], samples, leads.size());
+	if(type >= 0 && type < int(types.size()))
+		s += logRatio(types[type], samples, types.size());
+	return s;
+}
+
+double PacketModel::sizeScore(int size) const {
+	if(samples == 0 || size <= 0)
+		return 0;
+	return logRatio(sizes[sizeBucket(size)], samples, sizes.size());
+}
+
+bool PacketModel::unlikely(int lead, int type) const {
+	if(samples < MinModelSamples)
 		return false;
+	if(leads[lead] == 0)
+		return true;
+	return type >= 0 && type < int(types.size()) && types[type] == 0;
+}
+
+
+
+// Codec.
+Codec::Codec()
+	: context(NULL), codec(NULL), handler(CodecHandler::find("")),
+	  probe_frame(NULL), probe_packet(NULL) { }
+
+Codec::Codec(const Codec &other)
+	: name(other.name), context(other.context), codec(other.codec), model(other.model), handler(other.handler),
+	  probe_frame(NULL), probe_packet(NULL), aac(other.aac) { }
+
+Codec &Codec::operator=(const Codec &other) {
+	// Keep our own probe state.
+	name    = other.name;
+	context = other.context;
+	codec   = other.codec;
+	model   = other.model;
+	handler = other.handler;
+	aac     = other.aac;
+	return *this;
+}
+
+Codec::~Codec() {
+	av_frame_free(&probe_frame);
+	av_packet_free(&probe_packet);
+}
+
+void Codec::clear() {
+	name.clear();
+	// Do not remove the context, as it will be re-used!
+	codec   = NULL;
+	handler = CodecHandler::find(name);   // Matches nothing.
+	model.clear();
+	aac     = AacInfo();
+}
+
+bool Codec::parse(Atom *trak, SampleCursor &samples, Atom *mdat) {
+	Atom *stsd = trak->atomByName("stsd");
+	if(!stsd) {
+		cerr << "Missing 'Sample Descriptions' atom (stsd).\n";
+		return false;
+	}
+	int32_t entries = stsd->readInt(4);
+	if(entries != 1)
+		throw string("Multiplexed streams not supported");
+
+	char codec_name[5];
+	stsd->readChar(codec_name, 12, 4);
+	name = codec_name;
+	handler = CodecHandler::find(name);
+
+	// Learn what the packets look like.
+	model.clear();
+	model.types.assign(handler->packetTypes(), 0);
+	// With a mapping the heads are read from it directly, not one getFragment() each.
+	BufferedAtom        *buffered = dynamic_cast<BufferedAtom *>(mdat);
+	const unsigned char *mapped   = (buffered) ? buffered->mappedContent() : NULL;
+	while(samples.next()) {
+		int64_t offset = samples.offset;
+		int     size   = samples.size;
+		if(offset < mdat->start || uint64_t(offset - mdat->start) > mdat->length)
+			throw string("Invalid offset in track!");
+		if(size < 1 || offset < mdat->start + 8 || uint64_t(offset - mdat->start + 8) > mdat->length)
+			continue;
+
+		uint8_t head[8];
+		int64_t position = offset - mdat->start - 8;
+		if(mapped) {
+			memcpy(head, mapped + position, 8);
+		} else {
+			int64_t s = mdat->readInt64(position);
+			for(int b = 0; b < 8; b++)
+				head[b] = uint8_t(s >> (56 - 8*b));
+		}
+		model.add(head[0], handler->packetType(*this, head, min(size, 8)), size);
+	}
+
+	LOG(LogVerbose) << "Packet model for " << name << ": " << model.samples << " packets, sizes "
+		<< model.min_size << " to " << model.max_size << ".\n";
+	return true;
+}
+
+bool Codec::matchSample(const uint8_t *start, int maxlength) {
+	return handler->matchSample(*this, start, maxlength);
+}
+
+bool Codec::isKeyframe(const uint8_t *start, int maxlength) {
+	return handler->isKeyframe(*this, start, maxlength);
+}
+
+int Codec::getLength(const uint8_t *start, int maxlength, int &duration) {
+	return handler->getLength(*this, start, maxlength, duration);
+}
+
+double Codec::score(const uint8_t *start, int maxlength, int length) {
+	return model.score(start[0], handler->packetType(*this, start, maxlength)) + model.sizeScore(length);
+}
+
+bool Codec::unlikely(const uint8_t *start, int maxlength) {
+	return model.unlikely(start[0], handler->packetType(*this, start, maxlength));
+}
+
+
+
+// Sample cursor.
+SampleCursor::SampleCursor(Atom *trak)
+	: sample(-1), chunk(-1), offset(0), size(0), large(false),
+	  entry(-1), chunk_samples(0), left(0) {
+	stsz = trak->atomByName("stsz");
+	if(!stsz)
+		throw string("Missing 'Sample Sizes' atom (stsz)");
+	stsc = trak->atomByName("stsc");
+	if(!stsc)
+		throw string("Missing 'Sample to Chunk' atom (stsc)");
+	stco = trak->atomByName("stco");
+	if(!stco) {
+		stco  = trak->atomByName("co64");
+		large = true;
+		if(!stco)
+			throw string("Missing both 'Chunk Offset' atoms (stco & co64)");
+	}
+	default_size = stsz->readInt(4);
+	nsamples     = stsz->readInt(8);
+	nchunks      = stco->readInt(4);
+	nentries     = stsc->readInt(4);
+	next_first   = (nentries > 0) ? stsc->readInt(8) - 1 : nchunks;
+}
+
+bool SampleCursor::next() {
+	if(sample + 1 >= nsamples)
+		return false;
+	if(left > 0) {
+		offset += size;
+	} else {
+		// Next chunk with samples in it.
+		do {
+			chunk++;
+			while(entry + 1 < nentries && chunk >= next_first) {
+				entry++;
+				chunk_samples = stsc->readInt(12 + 12*entry);
+				next_first    = (entry + 1 < nentries) ? stsc->readInt(8 + 12*(entry + 1)) - 1 : nchunks;
+			}
+			if(chunk >= nchunks)
+				return false;
+		} while(entry < 0 || chunk_samples <= 0);   // Chunks before the first entry have no samples.
+		left   = chunk_samples;
+		offset = (large) ? stco->readInt64(8 + 8*chunk) : int64_t(uint32_t(stco->readInt(8 + 4*chunk)));
+	}
+	left--;
+	sample++;
+	size = (default_size != 0) ? default_size : stsz->readInt(12 + 4*sample);
+	return true;
 }
 
 
@@ -961,34 +1509,20 @@ bool Track::parse(Atom *t, Atom *mdat) {
 	timescale = mdhd->readInt(12);
 	duration  = mdhd->readInt(16);
 
-	times     = getSampleTimes(t);
-	keyframes = getKeyframes  (t);
-	sizes     = getSampleSizes(t);
-
-	vector<int> chunk_offsets   = getChunkOffsets(t);
-	vector<int> sample_to_chunk = getSampleToChunk(t, chunk_offsets.size());
-
-	if(times.size() != sizes.size()) {
-		clog << "Mismatch between time offsets and size offsets.\n";
-		clog << "Time offsets: " << times.size() << " Size offsets: " << sizes.size() << '\n';
-	}
-	//assert(times.size() == sizes.size());
-	if(times.size() != sample_to_chunk.size()) {
-		clog << "Mismatch between time offsets and sample_to_chunk offsets.\n";
-		clog << "Time offsets: " << times.size() << " Chunk offsets: " << sample_to_chunk.size() << '\n';
-	}
-	// Compute actual offsets.
-	int old_chunk = -1;
-	int offset = -1;
-	for(unsigned int i = 0; i < sizes.size(); i++) {
-		int chunk = sample_to_chunk[i];
-		int size = sizes[i];
-		if(chunk != old_chunk) {
-			offset = chunk_offsets[chunk];
-			old_chunk= chunk;
-		}
-		offsets.push_back(offset);
-		offset += size;
+	keyframes = getKeyframes(t);
+
+	// The samples are only walked (by the codec, to learn from them), not kept.
+	Atom *stts = t->atomByName("stts");
+	if(!stts)
+		throw string("Missing 'Sync Sample Table' atom (stts)");
+	int64_t ntimes  = 0;
+	int32_t entries = stts->readInt(4);
+	for(int i = 0; i < entries; i++)
+		ntimes += uint32_t(stts->readInt(8 + 8*i));
+	SampleCursor samples(t);
+	if(ntimes != samples.count()) {
+		LOG(LogInfo) << "Mismatch between time offsets and size offsets.\n";
+		LOG(LogInfo) << "Time offsets: " << ntimes << " Size offsets: " << samples.count() << '\n';
 	}
 
 	// Move this stuff into track!
@@ -1001,18 +1535,21 @@ bool Track::parse(Atom *t, Atom *mdat) {
 	hdlr->readChar(type, 8, 4);
 
 	if(type != string("soun") && type != string("vide")) {
-		clog << "Not an Audio nor Video track.\n";
+		LOG(LogInfo) << "Not an Audio nor Video track.\n";
 		return true;
 	}
 	// If audio, use next?
 	//bool audio = (type == string("soun"));
 
 	// Move this to Codec.
-	codec.parse(trak, offsets, mdat);
+	codec.parse(trak, samples, mdat);
+	if(samples.sample + 1 != samples.count()) {
+		LOG(LogInfo) << "Mismatch between size offsets and sample_to_chunk offsets.\n";
+		LOG(LogInfo) << "Size offsets: " << samples.count() << " Chunk offsets: " << samples.sample + 1 << '\n';
+	}
 	if(!codec.context)
 		throw string("No codec context.");
 	{
-		AvLog useAvLog();
 		codec.codec = avcodec_find_decoder(codec.context->codec_id);
 		if(!codec.codec)
 			throw string("No codec found!");
@@ -1109,7 +1646,7 @@ void Track::clear() {
 	offsets.clear();
 	sizes.clear();
 	keyframes.clear();
-	//times.clear();
+	times.clear();
 }
 
 void Track::fixTimes() {
@@ -1118,9 +1655,24 @@ void Track::fixTimes() {
 		times.resize(offsets.size(), 160);
 		return;
 	}
-	while(times.size() < offsets.size())
-		times.insert(times.end(), times.begin(), times.end());
-	times.resize(offsets.size());
+	if(times.size() != offsets.size()) {
+		// Repeat the sample durations of the reference (stts), run by run.
+		times.clear();
+		times.reserve(offsets.size());
+		Atom   *stts    = (trak) ? trak->atomByName("stts") : NULL;
+		int32_t entries = (stts) ? stts->readInt(4) : 0;
+		while(entries > 0 && times.size() < offsets.size()) {
+			size_t repeated = times.size();
+			for(int i = 0; i < entries && times.size() < offsets.size(); i++) {
+				uint32_t nsamples = stts->readInt( 8 + 8*i);
+				int32_t  time     = stts->readInt(12 + 8*i);
+				times.insert(times.end(), min(size_t(nsamples), offsets.size() - times.size()), time);
+			}
+			if(times.size() == repeated)
+				break;  // No samples in stts.
+		}
+		times.resize(offsets.size(), 0);
+	}
 
 	duration = 0;
 	for(unsigned int i = 0; i < times.size(); i++)
@@ -1128,24 +1680,6 @@ void Track::fixTimes() {
 }
 
 
-vector<int> Track::getSampleTimes(Atom *t) {
-	assert(t != NULL);
-	vector<int> sample_times;
-	// Chunk offsets.
-	Atom *stts = t->atomByName("stts");
-	if(!stts)
-		throw string("Missing 'Sync Sample Table' atom (stts)");
-
-	int32_t entries = stts->readInt(4);
-	for(int i = 0; i < entries; i++) {
-		int32_t nsamples = stts->readInt( 8 + 8*i);
-		int32_t time     = stts->readInt(12 + 8*i);
-		for(int i = 0; i < nsamples; i++)
-			sample_times.push_back(time);
-	}
-	return sample_times;
-}
-
 vector<int> Track::getKeyframes(Atom *t) {
 	assert(t != NULL);
 	vector<int> sample_key;
@@ -1160,80 +1694,15 @@ vector<int> Track::getKeyframes(Atom *t) {
 	return sample_key;
 }
 
-vector<int> Track::getSampleSizes(Atom *t) {
-	assert(t != NULL);
-	vector<int> sample_sizes;
-	// Chunk offsets.
-	Atom *stsz = t->atomByName("stsz");
-	if(!stsz)
-		throw string("Missing 'Sample Sizes' atom (stsz)");
-
-	int32_t entries      = stsz->readInt(8);
-	int32_t default_size = stsz->readInt(4);
-	if(default_size == 0) {
-		for(int i = 0; i < entries; i++)
-			sample_sizes.push_back(stsz->readInt(12 + 4*i));
-	} else {
-		sample_sizes.resize(entries, default_size);
-	}
-	return sample_sizes;
-}
-
-vector<int> Track::getChunkOffsets(Atom *t) {
-	assert(t != NULL);
-	vector<int> chunk_offsets;
-	// Chunk offsets.
-	Atom *stco = t->atomByName("stco");
-	if(stco) {
-		int32_t nchunks = stco->readInt(4);
-		for(int i = 0; i < nchunks; i++)
-			chunk_offsets.push_back(stco->readInt(8 + i*4));
-
-	} else {
-		Atom *co64 = t->atomByName("co64");
-		if(!co64)
-			throw string("Missing both 'Chunk Offset' atoms (stco & co64)");
-
-		int32_t nchunks = co64->readInt(4);
-		for(int i = 0; i < nchunks; i++) {
-			int32_t hi32 = co64->readInt( 8 + i*8); //high order 32-bits
-			int32_t lo32 = co64->readInt(12 + i*8); //low  order 32-bits
-			if(hi32 != 0) {
-				cerr << "Overflow: 64-bit Chunk Offset value too large ("
-					<< ((int64_t(hi32) << 32) | uint32_t(lo32)) << ").\n";
-			}
-			chunk_offsets.push_back(lo32);
-		}
-	}
-	return chunk_offsets;
-}
-
-vector<int> Track::getSampleToChunk(Atom *t, int nchunks){
-	assert(t != NULL);
-	vector<int> sample_to_chunk;
-
-	Atom *stsc = t->atomByName("stsc");
-	if(!stsc)
-		throw string("Missing 'Sample to Chunk' atom (stsc)");
-
-	vector<int> first_chunks;
-	int32_t entries = stsc->readInt(4);
-	for(int i = 0; i < entries; i++)
-		first_chunks.push_back(stsc->readInt(8 + 12*i));
-	first_chunks.push_back(nchunks+1);
-
-	for(int i = 0; i < entries; i++) {
-		int first_chunk = first_chunks[i];
-		int last_chunk  = first_chunks[i + 1];
-		int32_t nsamples = stsc->readInt(12 + 12*i);
-
-		for(int k = first_chunk; k < last_chunk; k++) {
-			for(int j = 0; j < nsamples; j++)
-				sample_to_chunk.push_back(k - 1);
-		}
+vector<int> Track::getChunkSamples() const {
+	vector<int> chunk_samples;
+	for(unsigned int i = 0; i < offsets.size(); i++) {
+		if(i > 0 && i - 1 < sizes.size() && offsets[i] == offsets[i - 1] + sizes[i - 1])
+			chunk_samples.back()++;
+		else
+			chunk_samples.push_back(1);
 	}
-
-	return sample_to_chunk;
+	return chunk_samples;
 }
 
 
@@ -1244,13 +1713,23 @@ void Track::saveSampleTimes() {
 	assert(stts);
 	if(!stts)
 		return;
+	// Run-length encoded: one entry per run of equal durations.
+	vector<int> runs;
+	for(unsigned int i = 0; i < times.size(); i++) {
+		if(i > 0 && times[i] == times[i - 1])
+			runs.back()++;
+		else
+			runs.push_back(1);
+	}
 	stts->content.resize(4 +                //version
 						 4 +                //entries
-						 8*times.size());   //time table
-	stts->writeInt(times.size(), 4);
-	for(unsigned int i = 0; i < times.size(); i++) {
-		stts->writeInt(1, 8 + 8*i);
-		stts->writeInt(times[i], 12 + 8*i);
+						 8*runs.size());    //time table
+	stts->writeInt(runs.size(), 4);
+	unsigned int sample = 0;
+	for(unsigned int i = 0; i < runs.size(); i++) {
+		stts->writeInt(runs[i], 8 + 8*i);
+		stts->writeInt(times[sample], 12 + 8*i);
+		sample += runs[i];
 	}
 }
 
@@ -1279,14 +1758,21 @@ void Track::saveSampleSizes() {
 	assert(stsz);
 	if(!stsz)
 		return;
+	// Use the default size (and no size table) when all samples have the same size.
+	bool constant = !sizes.empty();
+	for(unsigned int i = 1; i < sizes.size() && constant; i++)
+		constant = (sizes[i] == sizes[0]);
+
 	stsz->content.resize(4 +                //version
 						 4 +                //default size
 						 4 +                //entries
-						 4*sizes.size());   //size table
-	stsz->writeInt(0, 4);
+						 (constant ? 0 : 4*sizes.size()));   //size table
+	stsz->writeInt(constant ? sizes[0] : 0, 4);
 	stsz->writeInt(sizes.size(), 8);
-	for(unsigned int i = 0; i < sizes.size(); i++)
-		stsz->writeInt(sizes[i], 12 + 4*i);
+	if(!constant) {
+		for(unsigned int i = 0; i < sizes.size(); i++)
+			stsz->writeInt(sizes[i], 12 + 4*i);
+	}
 }
 
 void Track::saveSampleToChunk() {
@@ -1296,38 +1782,70 @@ void Track::saveSampleToChunk() {
 	assert(stsc);
 	if(!stsc)
 		return;
+	// One entry for each run of chunks with the same number of samples.
+	vector<int> chunk_samples = getChunkSamples();
+	vector<int> first_chunks;               //0 based
+	for(unsigned int i = 0; i < chunk_samples.size(); i++) {
+		if(i == 0 || chunk_samples[i] != chunk_samples[i - 1])
+			first_chunks.push_back(i);
+	}
 	stsc->content.resize(4 +                //version
 						 4 +                //number of entries
-						 12);               //one sample per chunk.
-	stsc->writeInt(1,  4);
-	stsc->writeInt(1,  8);                  //first chunk (1 based)
-	stsc->writeInt(1, 12);                  //one sample per chunk
-	stsc->writeInt(1, 16);                  //id 1 (WHAT IS THIS!)
+						 12*first_chunks.size());
+	stsc->writeInt(first_chunks.size(), 4);
+	for(unsigned int i = 0; i < first_chunks.size(); i++) {
+		stsc->writeInt(first_chunks[i] + 1,                8 + 12*i);  //first chunk (1 based)
+		stsc->writeInt(chunk_samples[first_chunks[i]],    12 + 12*i);  //samples per chunk
+		stsc->writeInt(1,                                 16 + 12*i);  //sample description (stsd entry)
+	}
 }
 
 void Track::saveChunkOffsets() {
 	if(!trak)
 		return;
-	Atom *co64 = trak->atomByName("co64");
-	if(co64) {
-		trak->prune("co64");
+	// The offset of the first sample of each chunk.
+	vector<int> chunk_samples = getChunkSamples();
+	vector<int64_t> chunk_offsets;
+	chunk_offsets.reserve(chunk_samples.size());
+	unsigned int sample = 0;
+	for(unsigned int i = 0; i < chunk_samples.size(); i++) {
+		chunk_offsets.push_back(offsets[sample]);
+		sample += chunk_samples[i];
+	}
+
+	// Switch to 64-bit chunk offsets (co64) only when some offset needs it.
+	bool large = false;
+	for(unsigned int i = 0; i < chunk_offsets.size() && !large; i++)
+		large = (chunk_offsets[i] > int64_t(UINT32_MAX));
+	const char *name  = (large) ? "co64" : "stco";
+	const char *other = (large) ? "stco" : "co64";
+
+	Atom *chunks = trak->atomByName(name);
+	if(!chunks) {
 		Atom *stbl = trak->atomByName("stbl");
-		if(stbl) {
-			Atom *new_stco = new Atom;
-			memcpy(new_stco->name, "stco", min(sizeof("stco"), sizeof(new_stco->name)-1));
-			stbl->children.push_back(new_stco);
+		assert(stbl);
+		if(!stbl)
+			return;
+		chunks = new Atom;
+		memcpy(chunks->name, name, min(sizeof("stco"), sizeof(chunks->name)-1));
+		Atom *old = stbl->atomByName(other);
+		if(old) {
+			stbl->replace(old, chunks);  // Keep its place in stbl; old is deleted.
+		} else {
+			stbl->addChild(chunks);
 		}
 	}
-	Atom *stco = trak->atomByName("stco");
-	assert(stco);
-	if(!stco)
-		return;
-	stco->content.resize(4 +                //version
-						 4 +                //number of entries
-						 4*offsets.size());
-	stco->writeInt(offsets.size(), 4);
-	for(unsigned int i = 0; i < offsets.size(); i++)
-		stco->writeInt(offsets[i], 8 + 4*i);
+	int entry_size = (large) ? 8 : 4;
+	chunks->content.resize(4 +                //version
+						   4 +                //number of entries
+						   entry_size*chunk_offsets.size());
+	chunks->writeInt(chunk_offsets.size(), 4);
+	for(unsigned int i = 0; i < chunk_offsets.size(); i++) {
+		if(large)
+			chunks->writeInt64(chunk_offsets[i], 8 + 8*i);
+		else
+			chunks->writeInt(uint32_t(chunk_offsets[i]), 8 + 4*i);
+	}
 }
 
 // vim:set ts=4 sw=4 sts=4 noet:
@@ -23,13 +23,83 @@
 #ifndef TRACK_H
 #define TRACK_H
 
+#include <stdint.h>
 #include <vector>
 #include <string>
 
 
 class Atom;
+class CodecHandler;
 struct AVCodecContext;
 struct AVCodec;
+struct AVFrame;
+struct AVPacket;
+
+
+// What the mp4a handler knows about an AAC stream (see track.cpp).
+struct AacInfo {
+    int sampling_index;     // From the AudioSpecificConfig; -1 if the block walker can't be used.
+    int channel_config;
+    int checked;            // Block lengths found by the walker and confirmed by the decoder.
+    int trusted;            // Block lengths taken from the walker since the decoder last checked one.
+    int frame_samples;      // Samples per packet, as reported by the decoder.
+
+    AacInfo() : sampling_index(-2), channel_config(0), checked(0), trusted(0), frame_samples(0) { }
+    bool parsed() const { return sampling_index != -2; }
+};
+
+
+// What the packets of a track look like in the reference file (see track.cpp).
+struct PacketModel {
+    int samples;                // Reference packets learned from.
+    int min_size;
+    int max_size;
+    std::vector<int> leads;     // Packets starting with each byte value.
+    std::vector<int> types;     // Packets of each type (the NAL type for avc1); empty if the codec has none.
+    std::vector<int> sizes;     // Packets with a size in each power of 2.
+
+    PacketModel() : samples(0), min_size(0), max_size(0) { }
+    void clear() { *this = PacketModel(); }
+    void add(int lead, int type, int size);
+
+    // Log-likelihood ratio against random bytes: > 0 looks like a packet of the track.
+    double score    (int lead, int type) const;
+    double sizeScore(int size) const;
+    // Lead byte or type never seen among enough reference packets to rule it out.
+    bool   unlikely (int lead, int type) const;
+};
+
+
+// Walks the samples of a track through its sample size (stsz),
+//  sample to chunk (stsc) and chunk offset (stco/co64) tables,
+//  reading their entries from the atoms as it goes.
+class SampleCursor {
+public:
+    explicit SampleCursor(Atom *trak);
+
+    int  count() const { return nsamples; }     // Samples in stsz.
+    // Move to the next sample; false past the last one, or when the chunks run out.
+    bool next();
+
+    int     sample;     // 0 based; -1 before the first next().
+    int     chunk;      // 0 based.
+    int64_t offset;
+    int     size;
+
+private:
+    Atom *stsz;
+    Atom *stsc;
+    Atom *stco;         // Or co64.
+    bool  large;        // stco is a co64.
+    int   nsamples;
+    int   default_size;
+    int   nchunks;
+    int   nentries;     // In stsc.
+    int   entry;        // Current stsc entry.
+    int   chunk_samples;    // Samples per chunk in the current entry.
+    int   next_first;       // First chunk (0 based) of the next entry.
+    int   left;             // Samples left in the current chunk.
+};
 
 
 class Codec {
@@ -37,20 +107,35 @@ public:
     std::string     name;
     AVCodecContext *context;
     AVCodec        *codec;
+    PacketModel     model;      // Learned in parse().
 
     Codec();
+    Codec(const Codec &other);              // The copy gets probe state of its own.
+    Codec &operator=(const Codec &other);
+    ~Codec();
 
-    bool parse(Atom *trak, std::vector<int> &offsets, Atom *mdat);
+    // Learns the model from the samples left in the cursor.
+    bool parse(Atom *trak, SampleCursor &samples, Atom *mdat);
     void clear();
 
-    bool matchSample(const unsigned char *start, int maxlength);
-    bool isKeyframe (const unsigned char *start, int maxlength);
-    int  getLength  (      unsigned char *start, int maxlength, int &duration);
+    // Called for every track at every offset scanned: dispatch without looking at name.
+    bool matchSample(const uint8_t *start, int maxlength);
+    bool isKeyframe (const uint8_t *start, int maxlength);
+    int  getLength  (const uint8_t *start, int maxlength, int &duration);
+    // What the model says of a packet starting here; cheap, unlike getLength().
+    double score   (const uint8_t *start, int maxlength, int length);
+    bool   unlikely(const uint8_t *start, int maxlength);
 
 private:
+    const CodecHandler *handler;    // Chosen by name in parse().
+    friend class CodecHandler;
+
+    // Reused by every getLength() that decodes (mp4a, mp4v), allocated on first use.
+    AVFrame  *probe_frame;
+    AVPacket *probe_packet;
+
     // Used by mp4a.
-    int mask1;
-    int mask0;
+    AacInfo aac;
 };
 
 
@@ -61,10 +146,11 @@ public:
     int   duration;
     Codec codec;
 
+    // Of the packets found; times stay empty until fixTimes(), unless known per packet.
     std::vector<int> times;
-    std::vector<int> keyframes; // 0 based!
+    std::vector<int> keyframes; // 0 based! Of the reference until clear().
     std::vector<int> sizes;
-    std::vector<int> offsets;   // Should be 64-bit!
+    std::vector<int64_t> offsets;
 
     Track();
 
@@ -76,11 +162,10 @@ public:
 protected:
     void cleanUp();
 
-    std::vector<int> getSampleTimes  (Atom *t);
-    std::vector<int> getKeyframes    (Atom *t);
-    std::vector<int> getSampleSizes  (Atom *t);
-    std::vector<int> getChunkOffsets (Atom *t);
-    std::vector<int> getSampleToChunk(Atom *t, int nchunks);
+    std::vector<int> getKeyframes  (Atom *t);
+
+    // Samples stored back to back form a chunk: number of samples in each chunk.
+    std::vector<int> getChunkSamples() const;
 
     void saveSampleTimes();
     void saveKeyframes();
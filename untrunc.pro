@@ -18,13 +18,16 @@ SOURCES += main.cpp \
     atom.cpp \
     mp4.cpp \
     file.cpp \
-    track.cpp
+    track.cpp \
+    log.cpp
 
 HEADERS += \
     atom.h \
     mp4.h \
     file.h \
     track.h \
+    log.h \
+    byteorder.h \
     AP_AtomDefinitions.h
 
 INCLUDEPATH += ../libav-12.3
@@ -36,9 +39,9 @@ LIBS += ../libav-12.3/libavformat/libavformat.a \
 
 #INCLUDEPATH += -I/usr/local/lib
 #LIBS += -L/usr/local/lib -lavformat -lavcodec -lavutil
-DEFINES += _FILE_OFFSET_BITS=64 VERBOSE VERBOSE1
+DEFINES += _FILE_OFFSET_BITS=64
 
-LIBS += -lz
+LIBS += -lz -lpthread
 
 #QMAKE_LFLAGS += -static
 #LIBS += /usr/lib/x86_64-linux-gnu/libavcodec.a \